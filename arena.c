@@ -0,0 +1,200 @@
+#include <u.h>
+#include <libc.h>
+#include "util.h"
+#include "arena.h"
+
+/*
+ * Arenas hand out chunks carved from large blocks,
+ * so there are no malloc headers per chunk and
+ * everything is released at once.
+ * Freed chunks are kept in per-size free lists;
+ * small sizes in Aquantum steps, large ones in
+ * powers of two.
+ * A nil arena means using malloc.
+ */
+
+static int
+aclass(int sz)
+{
+	int	c, n;
+
+	if(sz <= Asmall)
+		return (sz+Aquantum-1)/Aquantum - 1;
+	c = Asmall/Aquantum;
+	for(n = 2*Asmall; n < sz; n *= 2)
+		c++;
+	return c;
+}
+
+static int
+aclasssz(int c)
+{
+	if(c < Asmall/Aquantum)
+		return (c+1)*Aquantum;
+	return Asmall << (c - Asmall/Aquantum + 1);
+}
+
+Arena*
+newarena(void)
+{
+	return emallocz(sizeof(Arena), 1);
+}
+
+void
+freearena(Arena* a)
+{
+	Ablk*	b;
+	Adead*	d;
+
+	while((d = a->dead) != nil){
+		a->dead = d->next;
+		free(d);
+	}
+	while(a->blks != nil){
+		b = a->blks;
+		a->blks = b->next;
+		free(b);
+	}
+	free(a);
+}
+
+void*
+aalloc(Arena* a, int sz)
+{
+	int	c;
+	int	bsz;
+	Ablk*	b;
+	void*	p;
+
+	if(a == nil)
+		return emallocz(sz, 0);
+	c = aclass(sz);
+	sz = aclasssz(c);
+	a->nused += sz;
+	if(a->free[c] != nil){
+		p = a->free[c];
+		a->free[c] = *(void**)p;
+		return p;
+	}
+	if(a->p == nil || a->e - a->p < sz){
+		bsz = Ablksz;
+		if(sz > Ablksz/4)
+			bsz = sz;
+		b = emallocz(sizeof(Ablk) + bsz, 0);
+		b->next = a->blks;
+		a->blks = b;
+		a->nbytes += sizeof(Ablk) + bsz;
+		p = b + 1;
+		if(bsz == sz)
+			return p;
+		a->p = (uchar*)p;
+		a->e = a->p + bsz;
+	}
+	p = a->p;
+	a->p += sz;
+	return p;
+}
+
+void
+afree(Arena* a, void* p, int sz)
+{
+	int	c;
+
+	if(p == nil)
+		return;
+	if(a == nil){
+		free(p);
+		return;
+	}
+	c = aclass(sz);
+	a->nused -= aclasssz(c);
+	*(void**)p = a->free[c];
+	a->free[c] = p;
+}
+
+/*
+ * Tries may have versions read by others while the
+ * newest one changes, see trienext. Chunks older versions
+ * may be using are retired instead of freed, and taken
+ * with aretired to be freed with afreedead once none of
+ * those versions is used.
+ */
+
+void
+aretire(Arena* a, void* p, int sz)
+{
+	Adead*	d;
+
+	if(p == nil)
+		return;
+	assert(a != nil);
+	d = emallocz(sizeof(*d), 0);
+	d->p = p;
+	d->sz = sz;
+	d->next = a->dead;
+	a->dead = d;
+}
+
+/* Takes the chunks retired so far.
+ */
+Adead*
+aretired(Arena* a)
+{
+	Adead*	d;
+
+	d = a->dead;
+	a->dead = nil;
+	return d;
+}
+
+void
+afreedead(Arena* a, Adead* d)
+{
+	Adead*	n;
+
+	for(; d != nil; d = n){
+		n = d->next;
+		afree(a, d->p, d->sz);
+		free(d);
+	}
+}
+
+/* Growing arrays keep n items with
+ * room for tcap(n) items.
+ */
+int
+tcap(int n)
+{
+	int	c;
+
+	for(c = Amin; c < n; c *= 2)
+		;
+	return c;
+}
+
+void*
+talloc(Arena* a, int n, int sz)
+{
+	if(n == 0)
+		return nil;
+	return aalloc(a, tcap(n)*sz);
+}
+
+/* make room for one more item in the n items at p.
+ */
+void*
+tgrow(Arena* a, void* p, int n, int sz)
+{
+	void*	np;
+
+	if(p != nil && n < tcap(n))
+		return p;
+	if(a == nil)
+		return erealloc(p, tcap(n+1)*sz);
+	np = aalloc(a, tcap(n+1)*sz);
+	if(p != nil){
+		memmove(np, p, n*sz);
+		afree(a, p, tcap(n)*sz);
+	}
+	return np;
+}
@@ -0,0 +1,45 @@
+enum {
+	Ablksz = 256*1024,	// blocks taken from malloc
+	Aquantum = 8,	// size steps for small chunks
+	Asmall = 256,	// larger chunks use powers of two
+	Nclass = Asmall/Aquantum + 24,
+	Amin = 8,	// growing arrays have room for Amin items at least
+};
+
+typedef struct Arena Arena;
+typedef struct Ablk Ablk;
+typedef struct Adead Adead;
+
+struct Ablk {
+	Ablk*	next;
+};
+
+/* A chunk retired, see aretire.
+ */
+struct Adead {
+	Adead*	next;
+	void*	p;
+	int	sz;
+};
+
+struct Arena {
+	Ablk*	blks;	// blocks allocated
+	uchar*	p;	// free space in the last block
+	uchar*	e;
+	void*	free[Nclass];	// free chunks by size class
+	vlong	nbytes;	// bytes taken from malloc
+	vlong	nused;	// bytes in use
+	long	nnodes;	// trie nodes allocated
+	Adead*	dead;	// chunks retired, not yet taken
+};
+
+Arena*	newarena(void);
+void	freearena(Arena* a);
+void*	aalloc(Arena* a, int sz);
+void	afree(Arena* a, void* p, int sz);
+void	aretire(Arena* a, void* p, int sz);
+Adead*	aretired(Arena* a);
+void	afreedead(Arena* a, Adead* d);
+int	tcap(int n);
+void*	talloc(Arena* a, int n, int sz);
+void*	tgrow(Arena* a, void* p, int n, int sz);
@@ -0,0 +1,71 @@
+#include <u.h>
+#include <libc.h>
+#include <bio.h>
+#include "arena.h"
+#include "post.h"
+#include "docs.h"
+#include "trie.h"
+#include "util.h"
+
+/*
+ * Convert a trie database to the binary format,
+ * or back to the old text format with -t.
+ */
+
+void
+usage(void)
+{
+	fprint(2, "usage: %s [-t] trie [newtrie]\n", argv0);
+	exits("usage");
+}
+
+void
+main(int argc, char* argv[])
+{
+	Trie*	t;
+	Biobuf*	b;
+	Biobuf	bout;
+	int	fd;
+	int	tflag;
+	int	r;
+	char*	tfname;
+	char*	ttfname;
+
+	tflag = 0;
+	ARGBEGIN{
+	case 't':
+		tflag++;
+		break;
+	default:
+		usage();
+	}ARGEND;
+	if(argc != 1 && argc != 2)
+		usage();
+	tfname = argv[0];
+	b = Bopen(tfname, OREAD);
+	if(b == nil)
+		sysfatal("%s: %r", tfname);
+	t = rdtrie(b);
+	if(t == nil)
+		sysfatal("%s: %r", tfname);
+	Bterm(b);
+	if(argc == 2)
+		tfname = argv[1];
+	ttfname = smprint("%s.new", tfname);
+	fd = create(ttfname, OWRITE, 0664);
+	if(fd < 0)
+		sysfatal("%s: %r", ttfname);
+	Binit(&bout, fd, OWRITE);
+	if(tflag)
+		r = wrtrietext(&bout, t);
+	else
+		r = wrtrie(&bout, t);
+	if(r < 0 || Bterm(&bout) < 0){
+		remove(ttfname);
+		sysfatal("%s: %r", ttfname);
+	}
+	close(fd);
+	if(myrename(tfname, ttfname) < 0)
+		sysfatal("can't rename %s to %s: %r", ttfname, tfname);
+	exits(nil);
+}
@@ -0,0 +1,153 @@
+#include <u.h>
+#include <libc.h>
+#include <fcall.h>
+#include "util.h"
+#include "docs.h"
+
+/*
+ * Doc ids are given in order as new qids are seen,
+ * and a hash table with open addressing maps qids to
+ * them. The table is kept at most half full,
+ * and qids has room for ntab/2 entries.
+ */
+
+Docs*
+newdocs(void)
+{
+	return emallocz(sizeof(Docs), 1);
+}
+
+/* Docs for the n qids stored at p in an image.
+ * They can be translated to qids, but not looked up.
+ */
+Docs*
+imgdocs(uchar* p, int n)
+{
+	Docs*	d;
+
+	d = newdocs();
+	d->img = p;
+	d->n = n;
+	return d;
+}
+
+/* A copy of d as it is now, to be read while d gets
+ * new doc ids. Like imgdocs, it can't look them up.
+ * The qids of d are not freed from then on, until d is.
+ */
+Docs*
+frozendocs(Docs* d)
+{
+	Docs*	c;
+
+	c = newdocs();
+	c->qids = d->qids;
+	c->n = d->n;
+	c->img = d->img;
+	c->copy = 1;
+	d->frozen = 1;
+	return c;
+}
+
+void
+freedocs(Docs* d)
+{
+	int	i;
+
+	if(d != nil){
+		if(!d->copy)
+			free(d->qids);
+		for(i = 0; i < d->nold; i++)
+			free(d->old[i]);
+		free(d->old);
+		free(d->tab);
+		free(d);
+	}
+}
+
+static uint
+qhash(uvlong qid)
+{
+	qid *= 0x9E3779B97F4A7C15ULL;
+	return qid >> 32;
+}
+
+static void
+growtab(Docs* d)
+{
+	u32int	i;
+	uint	h;
+	uvlong*	q;
+
+	free(d->tab);
+	d->ntab = d->ntab ? 2*d->ntab : Dtab;
+	d->tab = emallocz(d->ntab*sizeof(u32int), 1);
+	if(d->frozen && d->qids != nil){
+		q = emallocz(d->ntab/2*sizeof(uvlong), 0);
+		memmove(q, d->qids, d->n*sizeof(uvlong));
+		d->old = erealloc(d->old, (d->nold+1)*sizeof(uvlong*));
+		d->old[d->nold++] = d->qids;
+		d->qids = q;
+	} else
+		d->qids = erealloc(d->qids, d->ntab/2*sizeof(uvlong));
+	for(i = 0; i < d->n; i++){
+		for(h = qhash(d->qids[i]) & (d->ntab-1); d->tab[h] != 0; h = (h+1) & (d->ntab-1))
+			;
+		d->tab[h] = i + 1;
+	}
+}
+
+/* Returns the position for qid in the table,
+ * which is free if qid is not there.
+ */
+static uint
+findqid(Docs* d, uvlong qid)
+{
+	uint	h;
+
+	for(h = qhash(qid) & (d->ntab-1); d->tab[h] != 0; h = (h+1) & (d->ntab-1))
+		if(d->qids[d->tab[h]-1] == qid)
+			break;
+	return h;
+}
+
+int
+lookdoc(Docs* d, uvlong qid, u32int* idp)
+{
+	uint	h;
+
+	if(d->ntab == 0)
+		return 0;
+	h = findqid(d, qid);
+	if(d->tab[h] == 0)
+		return 0;
+	*idp = d->tab[h] - 1;
+	return 1;
+}
+
+/* Returns the doc id for qid, adding it if new.
+ */
+u32int
+docid(Docs* d, uvlong qid)
+{
+	uint	h;
+
+	assert(d->img == nil);
+	if(2*(d->n+1) > d->ntab)
+		growtab(d);
+	h = findqid(d, qid);
+	if(d->tab[h] != 0)
+		return d->tab[h] - 1;
+	d->qids[d->n] = qid;
+	d->tab[h] = ++d->n;
+	return d->n - 1;
+}
+
+uvlong
+docqid(Docs* d, u32int id)
+{
+	assert(id < d->n);
+	if(d->img != nil)
+		return GBIT64(d->img + id*Dqidsz);
+	return d->qids[id];
+}
@@ -0,0 +1,30 @@
+enum {
+	Dtab = 1024,	// initial size of the qid hash table
+	Dqidsz = 8,	// qids in a binary database
+};
+
+typedef struct Docs Docs;
+
+/* Dense document ids for file qids.
+ * Posting lists keep doc ids, which are
+ * translated back to qids for output.
+ */
+struct Docs {
+	uvlong*	qids;	// qids by doc id
+	int	n;	// # of doc ids
+	u32int*	tab;	// 1 + doc id by qid hash, 0 if free
+	int	ntab;
+	uchar*	img;	// or qids in a database image
+	int	frozen;	// copies of qids were made, see frozendocs
+	uvlong**	old;	// qids arrays replaced, kept for them
+	int	nold;
+	int	copy;	// qids are those of another Docs
+};
+
+Docs*	newdocs(void);
+Docs*	imgdocs(uchar* p, int n);
+Docs*	frozendocs(Docs* d);
+void	freedocs(Docs* d);
+u32int	docid(Docs* d, uvlong qid);
+int	lookdoc(Docs* d, uvlong qid, u32int* idp);
+uvlong	docqid(Docs* d, u32int id);
@@ -0,0 +1,1066 @@
+#include <u.h>
+#include <libc.h>
+#include "util.h"
+#include "arena.h"
+#include "post.h"
+
+/*
+ * Posting lists for trie nodes.
+ * Values are kept sorted in blocks of Nblk to 2*Nblk
+ * values, each one delta and varint coded. Adding or
+ * looking for a value decodes at most a single block,
+ * found by binary search on the first values.
+ * Values added in increasing order are just appended.
+ *
+ * Large lists switch to roaring containers when those take
+ * less memory, which is the case for dense tags: values are
+ * grouped by their bits above the low 16 ones, and each group
+ * keeps the low bits in a sorted array or, past Carray values,
+ * in a bitmap. postand and postor work on the containers
+ * without decoding them.
+ *
+ * Lists copied for a new version of a trie (see trienext)
+ * share their arrays with the old one, which is still read.
+ * Changes copy the array of blocks or containers first, and
+ * then each block or container they change. What they replace
+ * is retired in the arena, not freed.
+ */
+
+int
+putvarint(uchar* p, uvlong v)
+{
+	int	n;
+
+	for(n = 0; v >= 0x80; n++){
+		p[n] = v|0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+/* Returns the number of bytes used, or -1 if
+ * there is no valid varint before e.
+ */
+int
+getvarint(uchar* p, uchar* e, uvlong* vp)
+{
+	uvlong	v;
+	int	n;
+
+	v = 0;
+	for(n = 0; p+n < e && n < Pvarint; n++){
+		v |= (uvlong)(p[n]&0x7f) << (7*n);
+		if((p[n]&0x80) == 0){
+			*vp = v;
+			return n+1;
+		}
+	}
+	return -1;
+}
+
+static int
+bcap(int n)
+{
+	int	c;
+
+	for(c = 1; c < n; c *= 2)
+		;
+	return c;
+}
+
+static void
+pfree(Arena* a, void* p, int sz, int shared)
+{
+	if(shared)
+		aretire(a, p, sz);
+	else
+		afree(a, p, sz);
+}
+
+/* p is a copy of a list an older version keeps.
+ */
+void
+postshare(Post* p)
+{
+	p->shared = p->blks != nil;
+}
+
+/* Gives p its own array of blocks or containers,
+ * which still share their values.
+ */
+static void
+postown(Arena* a, Post* p)
+{
+	void*	o;
+	int	i, sz;
+
+	if(!p->shared)
+		return;
+	p->shared = 0;
+	o = p->blks;
+	if(p->roar){
+		sz = bcap(p->nblks)*sizeof(Pcont);
+		p->conts = aalloc(a, sz);
+		memmove(p->conts, o, p->nblks*sizeof(Pcont));
+		for(i = 0; i < p->nblks; i++)
+			p->conts[i].shared = 1;
+	} else {
+		sz = bcap(p->nblks)*sizeof(Pblk);
+		p->blks = aalloc(a, sz);
+		memmove(p->blks, o, p->nblks*sizeof(Pblk));
+		for(i = 0; i < p->nblks; i++)
+			p->blks[i].shared = 1;
+	}
+	aretire(a, o, sz);
+}
+
+/* insert an empty block at i.
+ */
+static Pblk*
+newblk(Arena* a, Post* p, int i)
+{
+	Pblk*	nb;
+
+	if(p->blks == nil || p->nblks == bcap(p->nblks)){
+		nb = aalloc(a, bcap(p->nblks+1)*sizeof(Pblk));
+		memmove(nb, p->blks, i*sizeof(Pblk));
+		memmove(nb+i+1, p->blks+i, (p->nblks-i)*sizeof(Pblk));
+		afree(a, p->blks, bcap(p->nblks)*sizeof(Pblk));
+		p->blks = nb;
+	} else
+		memmove(p->blks+i+1, p->blks+i, (p->nblks-i)*sizeof(Pblk));
+	p->nblks++;
+	memset(&p->blks[i], 0, sizeof(Pblk));
+	return &p->blks[i];
+}
+
+static void
+growblk(Arena* a, Pblk* b, int nd)
+{
+	uchar*	d;
+	int	na;
+
+	if(b->shared){
+		d = nil;
+		if(b->adata > 0){
+			d = aalloc(a, b->adata);
+			memmove(d, b->data, b->ndata);
+		}
+		aretire(a, b->data, b->adata);
+		b->data = d;
+		b->shared = 0;
+	}
+	if(nd <= b->adata)
+		return;
+	na = 2*b->adata;
+	if(na < nd)
+		na = (nd+15)&~15;
+	d = aalloc(a, na);
+	memmove(d, b->data, b->ndata);
+	afree(a, b->data, b->adata);
+	b->data = d;
+	b->adata = na;
+}
+
+static void
+setblk(Arena* a, Pblk* b, u32int* v, int n)
+{
+	uchar	buf[2*Nblk*Pvarint];
+	int	i, nd;
+
+	nd = 0;
+	for(i = 1; i < n; i++)
+		nd += putvarint(buf+nd, v[i]-v[i-1]);
+	b->ndata = 0;
+	growblk(a, b, nd);
+	memmove(b->data, buf, nd);
+	b->ndata = nd;
+	b->n = n;
+	b->first = v[0];
+	b->last = v[n-1];
+}
+
+/* Decodes the values in b to v, up to a bad varint.
+ */
+static int
+getblk(Pblk* b, u32int* v)
+{
+	uchar*	p;
+	uchar*	e;
+	uvlong	d;
+	int	n, nc;
+
+	v[0] = b->first;
+	p = b->data;
+	e = p + b->ndata;
+	for(n = 1; p < e && n < b->n; n++){
+		nc = getvarint(p, e, &d);
+		if(nc < 0){
+			werrstr("bad value at %lld", (vlong)(p - b->data));
+			break;
+		}
+		p += nc;
+		v[n] = v[n-1] + d;
+	}
+	return n;
+}
+
+/* the last block starting at or before v, or the first one.
+ */
+static int
+findblk(Post* p, u32int v)
+{
+	int	l, h, m;
+
+	l = 0;
+	h = p->nblks;
+	while(l < h){
+		m = l + (h - l)/2;
+		if(p->blks[m].first <= v)
+			l = m + 1;
+		else
+			h = m;
+	}
+	if(l > 0)
+		l--;
+	return l;
+}
+
+static int
+popcnt(uvlong x)
+{
+	x = x - ((x>>1) & 0x5555555555555555ULL);
+	x = (x & 0x3333333333333333ULL) + ((x>>2) & 0x3333333333333333ULL);
+	x = (x + (x>>4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (x * 0x0101010101010101ULL) >> 56;
+}
+
+/* index of the lowest bit set in x, not zero.
+ */
+static int
+lowbit(uvlong x)
+{
+	return popcnt((x & -x) - 1);
+}
+
+/* insert an empty container at i.
+ */
+static Pcont*
+newcont(Arena* a, Post* p, int i)
+{
+	Pcont*	nc;
+
+	if(p->conts == nil || p->nblks == bcap(p->nblks)){
+		nc = aalloc(a, bcap(p->nblks+1)*sizeof(Pcont));
+		memmove(nc, p->conts, i*sizeof(Pcont));
+		memmove(nc+i+1, p->conts+i, (p->nblks-i)*sizeof(Pcont));
+		afree(a, p->conts, bcap(p->nblks)*sizeof(Pcont));
+		p->conts = nc;
+	} else
+		memmove(p->conts+i+1, p->conts+i, (p->nblks-i)*sizeof(Pcont));
+	p->nblks++;
+	memset(&p->conts[i], 0, sizeof(Pcont));
+	return &p->conts[i];
+}
+
+static void
+freecont(Arena* a, Pcont* c)
+{
+	if(c->bits != nil)
+		pfree(a, c->bits, Cwords*sizeof(uvlong), c->shared);
+	else
+		pfree(a, c->lo, tcap(c->n)*sizeof(ushort), c->shared);
+	c->bits = nil;
+	c->lo = nil;
+	c->n = 0;
+	c->shared = 0;
+}
+
+/* Gives c its own values, before changing them.
+ */
+static void
+ownc(Arena* a, Pcont* c)
+{
+	uvlong*	bits;
+	ushort*	lo;
+
+	if(!c->shared)
+		return;
+	c->shared = 0;
+	if(c->bits != nil){
+		bits = aalloc(a, Cwords*sizeof(uvlong));
+		memmove(bits, c->bits, Cwords*sizeof(uvlong));
+		aretire(a, c->bits, Cwords*sizeof(uvlong));
+		c->bits = bits;
+	} else if(c->lo != nil){
+		lo = talloc(a, c->n, sizeof(ushort));
+		memmove(lo, c->lo, c->n*sizeof(ushort));
+		aretire(a, c->lo, tcap(c->n)*sizeof(ushort));
+		c->lo = lo;
+	}
+}
+
+/* Turns an array container into a bitmap.
+ */
+static void
+tobits(Arena* a, Pcont* c)
+{
+	uvlong*	bits;
+	int	i;
+
+	bits = aalloc(a, Cwords*sizeof(uvlong));
+	memset(bits, 0, Cwords*sizeof(uvlong));
+	for(i = 0; i < c->n; i++)
+		bits[c->lo[i]>>6] |= 1ULL << (c->lo[i]&63);
+	afree(a, c->lo, tcap(c->n)*sizeof(ushort));
+	c->lo = nil;
+	c->bits = bits;
+}
+
+/* Turns a bitmap container with c->n <= Carray
+ * values into an array.
+ */
+static void
+toarray(Arena* a, Pcont* c)
+{
+	ushort*	lo;
+	uvlong	w;
+	int	i, n;
+
+	lo = talloc(a, c->n, sizeof(ushort));
+	n = 0;
+	for(i = 0; i < Cwords; i++)
+		for(w = c->bits[i]; w != 0; w &= w-1)
+			lo[n++] = i<<6 | lowbit(w);
+	afree(a, c->bits, Cwords*sizeof(uvlong));
+	c->bits = nil;
+	c->lo = lo;
+}
+
+/* the first container with a key not below k.
+ */
+static int
+findcont(Post* p, int k)
+{
+	int	l, h, m;
+
+	l = 0;
+	h = p->nblks;
+	while(l < h){
+		m = l + (h - l)/2;
+		if(p->conts[m].key < k)
+			l = m + 1;
+		else
+			h = m;
+	}
+	return l;
+}
+
+/* first position in lo[0:n] not below x.
+ */
+static int
+findlo(ushort* lo, int n, int x)
+{
+	int	l, h, m;
+
+	l = 0;
+	h = n;
+	while(l < h){
+		m = l + (h - l)/2;
+		if(lo[m] < x)
+			l = m + 1;
+		else
+			h = m;
+	}
+	return l;
+}
+
+static int
+roaradd(Arena* a, Post* p, u32int v)
+{
+	Pcont*	c;
+	int	ci, i, x;
+
+	ci = findcont(p, v>>16);
+	if(ci == p->nblks || p->conts[ci].key != v>>16){
+		c = newcont(a, p, ci);
+		c->key = v>>16;
+	}
+	c = &p->conts[ci];
+	x = v & 0xFFFF;
+	if(c->bits == nil){
+		i = findlo(c->lo, c->n, x);
+		if(i < c->n && c->lo[i] == x)
+			return 0;
+		ownc(a, c);
+		if(c->n == Carray)
+			tobits(a, c);
+		else {
+			c->lo = tgrow(a, c->lo, c->n, sizeof(ushort));
+			memmove(c->lo+i+1, c->lo+i, (c->n-i)*sizeof(ushort));
+			c->lo[i] = x;
+			c->n++;
+			p->n++;
+			return 1;
+		}
+	}
+	if(c->bits[x>>6] & 1ULL<<(x&63))
+		return 0;
+	ownc(a, c);
+	c->bits[x>>6] |= 1ULL<<(x&63);
+	c->n++;
+	p->n++;
+	return 1;
+}
+
+static int
+roarhas(Post* p, u32int v)
+{
+	Pcont*	c;
+	int	ci, i, x;
+
+	ci = findcont(p, v>>16);
+	if(ci == p->nblks || p->conts[ci].key != v>>16)
+		return 0;
+	c = &p->conts[ci];
+	x = v & 0xFFFF;
+	if(c->bits != nil)
+		return (c->bits[x>>6] & 1ULL<<(x&63)) != 0;
+	i = findlo(c->lo, c->n, x);
+	return i < c->n && c->lo[i] == x;
+}
+
+static int
+roarvals(Post* p, u32int* v, int max)
+{
+	Pcont*	c;
+	uvlong	w;
+	int	ci, i, n;
+
+	n = 0;
+	for(ci = 0; ci < p->nblks && n < max; ci++){
+		c = &p->conts[ci];
+		if(c->bits == nil)
+			for(i = 0; i < c->n && n < max; i++)
+				v[n++] = (u32int)c->key<<16 | c->lo[i];
+		else
+			for(i = 0; i < Cwords && n < max; i++)
+				for(w = c->bits[i]; w != 0 && n < max; w &= w-1)
+					v[n++] = (u32int)c->key<<16 | i<<6 | lowbit(w);
+	}
+	return n;
+}
+
+/* Set containers for an empty list from n sorted
+ * values without duplicates.
+ */
+static void
+roarset(Arena* a, Post* p, u32int* v, int n)
+{
+	Pcont*	c;
+	int	i, j, k;
+
+	p->roar = 1;
+	for(i = 0; i < n; i = j){
+		for(j = i+1; j < n && v[j]>>16 == v[i]>>16; j++)
+			;
+		c = newcont(a, p, p->nblks);
+		c->key = v[i]>>16;
+		c->n = j - i;
+		if(c->n > Carray){
+			c->bits = aalloc(a, Cwords*sizeof(uvlong));
+			memset(c->bits, 0, Cwords*sizeof(uvlong));
+			for(k = i; k < j; k++)
+				c->bits[(v[k]&0xFFFF)>>6] |= 1ULL << (v[k]&63);
+		} else {
+			c->lo = talloc(a, c->n, sizeof(ushort));
+			for(k = i; k < j; k++)
+				c->lo[k-i] = v[k] & 0xFFFF;
+		}
+	}
+	p->n += n;
+}
+
+/* Memory for n sorted values as containers,
+ * and as delta coded blocks.
+ */
+static vlong
+roarsz(u32int* v, int n)
+{
+	vlong	sz;
+	int	i, j;
+
+	sz = 0;
+	for(i = 0; i < n; i = j){
+		for(j = i+1; j < n && v[j]>>16 == v[i]>>16; j++)
+			;
+		sz += sizeof(Pcont);
+		if(j - i > Carray)
+			sz += Cwords*sizeof(uvlong);
+		else
+			sz += tcap(j-i)*sizeof(ushort);
+	}
+	return sz;
+}
+
+static vlong
+deltasz(u32int* v, int n)
+{
+	uchar	buf[Pvarint];
+	vlong	sz;
+	int	i;
+
+	sz = (n+Nblk-1)/Nblk * sizeof(Pblk);
+	for(i = 1; i < n; i++)
+		if(i%Nblk != 0)
+			sz += putvarint(buf, v[i]-v[i-1]);
+	return sz;
+}
+
+/* Called as a block list grows; moves
+ * it to containers if they are smaller.
+ */
+static void
+chkroar(Arena* a, Post* p)
+{
+	u32int*	v;
+	vlong	sz;
+	int	i, n;
+
+	sz = p->nblks*sizeof(Pblk);
+	for(i = 0; i < p->nblks; i++)
+		sz += p->blks[i].ndata;
+	n = p->n;
+	v = emallocz(n*sizeof(u32int), 0);
+	postvals(p, v);
+	if(roarsz(v, n) < sz){
+		freepost(a, p);
+		roarset(a, p, v, n);
+	}
+	free(v);
+}
+
+static int
+blkadd(Arena* a, Post* p, u32int v);
+
+/* Returns 1 if v is a new value.
+ */
+int
+postadd(Arena* a, Post* p, u32int v)
+{
+	if(p->shared && posthas(p, v))
+		return 0;
+	postown(a, p);
+	if(p->roar)
+		return roaradd(a, p, v);
+	if(!blkadd(a, p, v))
+		return 0;
+	if(p->n >= Nroar && (p->n & (p->n-1)) == 0)
+		chkroar(a, p);
+	return 1;
+}
+
+static int
+blkadd(Arena* a, Post* p, u32int v)
+{
+	u32int	vs[2*Nblk+1];
+	uchar	buf[Pvarint];
+	Pblk*	b;
+	int	bi, i, n, nd;
+	int	l, h, m;
+
+	if(p->nblks == 0){
+		b = newblk(a, p, 0);
+		b->first = b->last = v;
+		b->n = 1;
+		p->n++;
+		return 1;
+	}
+	bi = findblk(p, v);
+	b = &p->blks[bi];
+	if(v == b->first || v == b->last)
+		return 0;
+	if(v > b->last && b->n < 2*Nblk){
+		// v goes between this block and the next one.
+		nd = putvarint(buf, v - b->last);
+		growblk(a, b, b->ndata + nd);
+		memmove(b->data + b->ndata, buf, nd);
+		b->ndata += nd;
+		b->last = v;
+		b->n++;
+		p->n++;
+		return 1;
+	}
+	n = getblk(b, vs);
+	l = 0;
+	h = n;
+	while(l < h){
+		m = l + (h - l)/2;
+		if(vs[m] < v)
+			l = m + 1;
+		else
+			h = m;
+	}
+	if(l < n && vs[l] == v)
+		return 0;
+	memmove(vs+l+1, vs+l, (n-l)*sizeof(u32int));
+	vs[l] = v;
+	n++;
+	p->n++;
+	if(n <= 2*Nblk){
+		setblk(a, b, vs, n);
+		return 1;
+	}
+	newblk(a, p, bi+1);
+	i = n/2;
+	setblk(a, &p->blks[bi], vs, i);
+	setblk(a, &p->blks[bi+1], vs+i, n-i);
+	return 1;
+}
+
+int
+posthas(Post* p, u32int v)
+{
+	u32int	vs[2*Nblk];
+	Pblk*	b;
+	int	i, n;
+
+	if(p->roar)
+		return roarhas(p, v);
+	if(p->nblks == 0)
+		return 0;
+	b = &p->blks[findblk(p, v)];
+	if(v < b->first || v > b->last)
+		return 0;
+	n = getblk(b, vs);
+	for(i = 0; i < n && vs[i] < v; i++)
+		;
+	return i < n && vs[i] == v;
+}
+
+/* Decodes all values, in order.
+ * v must have room for p->n values.
+ */
+int
+postvals(Post* p, u32int* v)
+{
+	return postfirst(p, v, p->n);
+}
+
+/* Decode the first values, at least max of them
+ * if there are, and at most max+2*Nblk-1.
+ * v must have room for that many.
+ */
+int
+postfirst(Post* p, u32int* v, int max)
+{
+	int	i, n;
+
+	if(p->roar)
+		return roarvals(p, v, max);
+	n = 0;
+	for(i = 0; i < p->nblks && n < max; i++)
+		n += getblk(&p->blks[i], v+n);
+	return n;
+}
+
+/* Set the values for an empty posting list
+ * from n sorted values without duplicates.
+ */
+void
+postset(Arena* a, Post* p, u32int* v, int n)
+{
+	int	i, nb;
+
+	if(n >= Nroar && roarsz(v, n) < deltasz(v, n)){
+		roarset(a, p, v, n);
+		return;
+	}
+	for(i = 0; i < n; i += nb){
+		nb = n - i;
+		if(nb > Nblk)
+			nb = Nblk;
+		setblk(a, newblk(a, p, p->nblks), v+i, nb);
+	}
+	p->n += n;
+}
+
+void
+freepost(Arena* a, Post* p)
+{
+	int	i;
+
+	postown(a, p);
+	if(p->roar){
+		for(i = 0; i < p->nblks; i++)
+			freecont(a, &p->conts[i]);
+		afree(a, p->conts, bcap(p->nblks)*sizeof(Pcont));
+	} else {
+		for(i = 0; i < p->nblks; i++)
+			pfree(a, p->blks[i].data, p->blks[i].adata, p->blks[i].shared);
+		afree(a, p->blks, bcap(p->nblks)*sizeof(Pblk));
+	}
+	p->blks = nil;
+	p->nblks = 0;
+	p->n = 0;
+	p->roar = 0;
+}
+
+/* The values as a single stream of varint deltas,
+ * the first one from zero, in memory from malloc.
+ */
+uchar*
+postdelta(Post* p, int* nbytes)
+{
+	uchar*	d;
+	u32int*	v;
+	u32int	last;
+	Pblk*	b;
+	int	i, n;
+
+	d = emallocz(p->n*Pvarint + 1, 0);
+	n = 0;
+	if(p->roar){
+		v = emallocz(p->n*sizeof(u32int) + 1, 0);
+		postvals(p, v);
+		for(i = 0; i < p->n; i++)
+			n += putvarint(d+n, v[i] - (i > 0 ? v[i-1] : 0));
+		free(v);
+	} else {
+		// the blocks are already delta coded.
+		last = 0;
+		for(i = 0; i < p->nblks; i++){
+			b = &p->blks[i];
+			n += putvarint(d+n, b->first - last);
+			memmove(d+n, b->data, b->ndata);
+			n += b->ndata;
+			last = b->last;
+		}
+	}
+	*nbytes = n;
+	return d;
+}
+
+/* Sets an empty container from the n low bits in lo.
+ */
+static void
+setlo(Arena* a, Pcont* c, ushort* lo, int n)
+{
+	c->lo = talloc(a, n, sizeof(ushort));
+	memmove(c->lo, lo, n*sizeof(ushort));
+	c->n = n;
+}
+
+/* c = x & y, for containers with the same key.
+ * lo has room for Carray values.
+ */
+static void
+contand(Arena* a, Pcont* c, Pcont* x, Pcont* y, ushort* lo)
+{
+	Pcont*	t;
+	int	i, j, n;
+
+	if(x->bits != nil && y->bits != nil){
+		c->bits = aalloc(a, Cwords*sizeof(uvlong));
+		n = 0;
+		for(i = 0; i < Cwords; i++){
+			c->bits[i] = x->bits[i] & y->bits[i];
+			n += popcnt(c->bits[i]);
+		}
+		c->n = n;
+		if(n <= Carray)
+			toarray(a, c);
+		return;
+	}
+	if(x->bits != nil){
+		t = x;
+		x = y;
+		y = t;
+	}
+	// x is an array now.
+	n = 0;
+	if(y->bits != nil){
+		for(i = 0; i < x->n; i++)
+			if(y->bits[x->lo[i]>>6] & 1ULL<<(x->lo[i]&63))
+				lo[n++] = x->lo[i];
+	} else
+		for(i = j = 0; i < x->n && j < y->n; )
+			if(x->lo[i] < y->lo[j])
+				i++;
+			else if(x->lo[i] > y->lo[j])
+				j++;
+			else {
+				lo[n++] = x->lo[i];
+				i++;
+				j++;
+			}
+	setlo(a, c, lo, n);
+}
+
+/* c = x | y, for containers with the same key.
+ * lo has room for 2*Carray values.
+ */
+static void
+contor(Arena* a, Pcont* c, Pcont* x, Pcont* y, ushort* lo)
+{
+	Pcont*	t;
+	int	i, j, n;
+
+	if(x->bits == nil && y->bits == nil){
+		n = 0;
+		for(i = j = 0; i < x->n || j < y->n; )
+			if(j == y->n || i < x->n && x->lo[i] < y->lo[j])
+				lo[n++] = x->lo[i++];
+			else if(i == x->n || y->lo[j] < x->lo[i])
+				lo[n++] = y->lo[j++];
+			else {
+				lo[n++] = x->lo[i];
+				i++;
+				j++;
+			}
+		if(n <= Carray){
+			setlo(a, c, lo, n);
+			return;
+		}
+		c->bits = aalloc(a, Cwords*sizeof(uvlong));
+		memset(c->bits, 0, Cwords*sizeof(uvlong));
+		for(i = 0; i < n; i++)
+			c->bits[lo[i]>>6] |= 1ULL << (lo[i]&63);
+		c->n = n;
+		return;
+	}
+	if(x->bits == nil){
+		t = x;
+		x = y;
+		y = t;
+	}
+	// x is a bitmap now.
+	c->bits = aalloc(a, Cwords*sizeof(uvlong));
+	memmove(c->bits, x->bits, Cwords*sizeof(uvlong));
+	if(y->bits != nil)
+		for(i = 0; i < Cwords; i++)
+			c->bits[i] |= y->bits[i];
+	else
+		for(i = 0; i < y->n; i++)
+			c->bits[y->lo[i]>>6] |= 1ULL << (y->lo[i]&63);
+	n = 0;
+	for(i = 0; i < Cwords; i++)
+		n += popcnt(c->bits[i]);
+	c->n = n;
+}
+
+/* r = x & y. The lists must use containers, or be empty;
+ * r must be empty, and gets containers.
+ * Queries run on small proc stacks: the buffer
+ * for merging containers comes from malloc.
+ */
+void
+postand(Arena* a, Post* r, Post* x, Post* y)
+{
+	Pcont*	c;
+	ushort*	lo;
+	int	i, j;
+
+	assert((x->roar || x->nblks == 0) && (y->roar || y->nblks == 0));
+	r->roar = 1;
+	lo = emallocz(Carray*sizeof(ushort), 0);
+	for(i = j = 0; i < x->nblks && j < y->nblks; )
+		if(x->conts[i].key < y->conts[j].key)
+			i++;
+		else if(x->conts[i].key > y->conts[j].key)
+			j++;
+		else {
+			c = newcont(a, r, r->nblks);
+			c->key = x->conts[i].key;
+			contand(a, c, &x->conts[i], &y->conts[j], lo);
+			if(c->n == 0){
+				freecont(a, c);
+				r->nblks--;
+			}
+			r->n += c->n;
+			i++;
+			j++;
+		}
+	free(lo);
+}
+
+static Pcont nocont;
+
+/* r = x | y, as postand does.
+ */
+void
+postor(Arena* a, Post* r, Post* x, Post* y)
+{
+	Pcont*	c;
+	Pcont*	xc;
+	Pcont*	yc;
+	ushort*	lo;
+	int	i, j;
+
+	assert((x->roar || x->nblks == 0) && (y->roar || y->nblks == 0));
+	r->roar = 1;
+	lo = emallocz(2*Carray*sizeof(ushort), 0);
+	for(i = j = 0; i < x->nblks || j < y->nblks; ){
+		xc = i < x->nblks ? &x->conts[i] : nil;
+		yc = j < y->nblks ? &y->conts[j] : nil;
+		c = newcont(a, r, r->nblks);
+		if(yc == nil || xc != nil && xc->key < yc->key){
+			c->key = xc->key;
+			contor(a, c, xc, &nocont, lo);
+			i++;
+		} else if(xc == nil || yc->key < xc->key){
+			c->key = yc->key;
+			contor(a, c, yc, &nocont, lo);
+			j++;
+		} else {
+			c->key = xc->key;
+			contor(a, c, xc, yc, lo);
+			i++;
+			j++;
+		}
+		r->n += c->n;
+	}
+	free(lo);
+}
+
+/*
+ * Occurrence counts. Values seen once have no entry,
+ * so lists for tags found once per file cost nothing.
+ */
+
+static uint
+fhash(u32int v)
+{
+	return (v * 0x9E3779B9U) >> 8;
+}
+
+static Pfent*
+findfreq(Pfreq* f, u32int v)
+{
+	uint	h;
+
+	for(h = fhash(v) & (f->ntab-1); f->tab[h].id != 0; h = (h+1) & (f->ntab-1))
+		if(f->tab[h].id == v+1)
+			break;
+	return &f->tab[h];
+}
+
+static void
+growfreq(Arena* a, Pfreq* f)
+{
+	Pfent*	otab;
+	int	ontab, i;
+
+	otab = f->tab;
+	ontab = f->ntab;
+	f->ntab = ontab ? 2*ontab : Pftab;
+	f->tab = aalloc(a, f->ntab*sizeof(Pfent));
+	memset(f->tab, 0, f->ntab*sizeof(Pfent));
+	for(i = 0; i < ontab; i++)
+		if(otab[i].id != 0)
+			*findfreq(f, otab[i].id-1) = otab[i];
+	afree(a, otab, ontab*sizeof(Pfent));
+}
+
+/* f is a copy of counts an older version keeps.
+ */
+void
+freqshare(Pfreq* f)
+{
+	f->shared = f->tab != nil;
+}
+
+/* Count v as seen n more times.
+ */
+void
+freqadd(Arena* a, Pfreq* f, u32int v, int n)
+{
+	Pfent*	e;
+	Pfent*	tab;
+
+	if(n <= 0)
+		return;
+	if(f->shared){
+		tab = aalloc(a, f->ntab*sizeof(Pfent));
+		memmove(tab, f->tab, f->ntab*sizeof(Pfent));
+		aretire(a, f->tab, f->ntab*sizeof(Pfent));
+		f->tab = tab;
+		f->shared = 0;
+	}
+	if(2*(f->n+1) > f->ntab)
+		growfreq(a, f);
+	e = findfreq(f, v);
+	if(e->id == 0){
+		e->id = v+1;
+		e->n = 1;
+		f->n++;
+	}
+	e->n += n;
+}
+
+/* Times v was seen, for a value in the list.
+ */
+int
+freqget(Pfreq* f, u32int v)
+{
+	Pfent*	e;
+
+	if(f->n == 0)
+		return 1;
+	e = findfreq(f, v);
+	if(e->id == 0)
+		return 1;
+	return e->n;
+}
+
+static int
+fentcmp(const void* a1, const void* a2)
+{
+	const Pfent* e1 = a1;
+	const Pfent* e2 = a2;
+
+	if(e1->id < e2->id)
+		return -1;
+	return e1->id > e2->id;
+}
+
+/* The counts as varint pairs, the delta from the
+ * previous value and the count, sorted by value,
+ * in memory from malloc.
+ */
+uchar*
+freqdelta(Pfreq* f, int* nbytes)
+{
+	Pfent*	es;
+	uchar*	d;
+	u32int	last;
+	int	i, n, ne;
+
+	es = emallocz(f->n*sizeof(Pfent) + 1, 0);
+	for(i = ne = 0; i < f->ntab; i++)
+		if(f->tab[i].id != 0)
+			es[ne++] = f->tab[i];
+	qsort(es, ne, sizeof(Pfent), fentcmp);
+	d = emallocz(2*ne*Pvarint + 1, 0);
+	n = 0;
+	last = 0;
+	for(i = 0; i < ne; i++){
+		n += putvarint(d+n, es[i].id-1 - last);
+		n += putvarint(d+n, es[i].n);
+		last = es[i].id-1;
+	}
+	free(es);
+	*nbytes = n;
+	return d;
+}
+
+void
+freefreq(Arena* a, Pfreq* f)
+{
+	pfree(a, f->tab, f->ntab*sizeof(Pfent), f->shared);
+	f->tab = nil;
+	f->ntab = 0;
+	f->n = 0;
+	f->shared = 0;
+}
@@ -0,0 +1,91 @@
+enum {
+	Nblk = 64,	// values per posting block, up to 2*Nblk before splitting
+	Pvarint = 10,	// max bytes for a varint
+
+	/* roaring containers
+	 */
+	Nroar = 4096,	// lists this large may use containers
+	Carray = 4096,	// containers with more values use bitmaps
+	Cwords = 65536/64,	// uvlongs in a bitmap
+
+	Pftab = 8,	// initial size for occurrence counts
+};
+
+typedef struct Post Post;
+typedef struct Pblk Pblk;
+typedef struct Pcont Pcont;
+typedef struct Pfreq Pfreq;
+typedef struct Pfent Pfent;
+
+/* Values in a block are sorted, coded as
+ * varint deltas after the first one.
+ */
+struct Pblk {
+	u32int	first;	// first value in the block
+	u32int	last;	// and the last one
+	uchar*	data;	// deltas for the rest
+	ushort	n;	// # of values in the block
+	ushort	ndata;	// bytes used in data
+	ushort	adata;	// bytes allocated for data
+	uchar	shared;	// data is an older version's
+};
+
+/* Values sharing the bits above the low 16 ones,
+ * as a sorted array of the low bits or as a bitmap.
+ */
+struct Pcont {
+	ushort	key;	// value >> 16
+	uchar	shared;	// lo or bits are an older version's
+	int	n;	// # of values
+	ushort*	lo;	// low bits if n <= Carray
+	uvlong*	bits;	// or the bitmap
+};
+
+/* A posting list: a sorted set of values
+ * kept in disjoint blocks, or in roaring
+ * containers when that takes less memory.
+ */
+struct Post {
+	int	n;	// # of values
+	int	nblks;	// # of blocks or containers
+	union {
+		Pblk*	blks;
+		Pcont*	conts;	// if roar
+	};
+	int	roar;
+	int	shared;	// blks or conts are an older version's
+};
+
+struct Pfent {
+	u32int	id;	// value + 1, or 0 if free
+	u32int	n;	// # of times seen
+};
+
+/* How many times values in a posting list were seen,
+ * for those seen more than once. A hash table with
+ * open addressing, at most half full.
+ */
+struct Pfreq {
+	Pfent*	tab;
+	int	ntab;
+	int	n;	// # of entries used
+	int	shared;	// tab is an older version's
+};
+
+int	postadd(Arena* a, Post* p, u32int v);
+int	posthas(Post* p, u32int v);
+int	postvals(Post* p, u32int* v);
+int	postfirst(Post* p, u32int* v, int max);
+void	postset(Arena* a, Post* p, u32int* v, int n);
+void	freepost(Arena* a, Post* p);
+void	postshare(Post* p);
+uchar*	postdelta(Post* p, int* nbytes);
+void	postand(Arena* a, Post* r, Post* x, Post* y);
+void	postor(Arena* a, Post* r, Post* x, Post* y);
+void	freqadd(Arena* a, Pfreq* f, u32int v, int n);
+int	freqget(Pfreq* f, u32int v);
+uchar*	freqdelta(Pfreq* f, int* nbytes);
+void	freefreq(Arena* a, Pfreq* f);
+void	freqshare(Pfreq* f);
+int	putvarint(uchar* p, uvlong v);
+int	getvarint(uchar* p, uchar* e, uvlong* vp);
@@ -2,9 +2,100 @@
 #include <libc.h>
 #include <bio.h>
 #include "util.h"
+#include "arena.h"
+#include "post.h"
+#include "docs.h"
 #include "trie.h"
+#include "sets.h"
 #include "query.h"
 
+/*
+ * Buffers for values are kept in a small pool when
+ * released, and reused for the next results, so
+ * evaluating a query seldom allocates them.
+ * Queries may be evaluated by several procs.
+ */
+
+static Lock	vpoollk;
+static u32int*	vpool[Npool];
+static int	vpoolsz[Npool];
+static int	nvpool;
+
+/* A buffer for at least n values; *ap gets its size.
+ */
+static u32int*
+getvbuf(int n, int* ap)
+{
+	u32int*	b;
+	int	i, bi;
+
+	lock(&vpoollk);
+	bi = -1;
+	for(i = 0; i < nvpool; i++)
+		if(vpoolsz[i] >= n && (bi < 0 || vpoolsz[i] < vpoolsz[bi]))
+			bi = i;
+	if(bi < 0){
+		unlock(&vpoollk);
+		*ap = n;
+		return emallocz(n*sizeof(u32int), 0);
+	}
+	b = vpool[bi];
+	*ap = vpoolsz[bi];
+	nvpool--;
+	vpool[bi] = vpool[nvpool];
+	vpoolsz[bi] = vpoolsz[nvpool];
+	unlock(&vpoollk);
+	return b;
+}
+
+static void
+putvbuf(u32int* b, int n)
+{
+	u32int*	old;
+	int	i, si;
+
+	if(b == nil)
+		return;
+	if(n > Poolmax){
+		free(b);
+		return;
+	}
+	lock(&vpoollk);
+	if(nvpool < Npool){
+		vpool[nvpool] = b;
+		vpoolsz[nvpool++] = n;
+		unlock(&vpoollk);
+		return;
+	}
+	// replace the smallest one, if smaller.
+	si = 0;
+	for(i = 1; i < nvpool; i++)
+		if(vpoolsz[i] < vpoolsz[si])
+			si = i;
+	if(vpoolsz[si] < n){
+		old = vpool[si];
+		vpool[si] = b;
+		vpoolsz[si] = n;
+		b = old;
+	}
+	unlock(&vpoollk);
+	free(b);
+}
+
+/* Operands of Tand and Tnot need parens if they are Tor.
+ */
+static void
+printsubexpr(Texpr* e)
+{
+	if(e->op != Tor){
+		printexpr(e);
+		return;
+	}
+	print("(");
+	printexpr(e);
+	print(")");
+}
+
 void
 printexpr(Texpr* e)
 {
@@ -14,15 +105,19 @@ printexpr(Texpr* e)
 	case Ttag:
 		print("%s", e->tag);
 		break;
+	case Tnot:
+		print("!");
+		printsubexpr(e->tagls[0]);
+		break;
 	case Tand:
 	case Tor:
-		printexpr(e->tagls[0]);
-		for(i = 1; i < e->arity; i++){
+		for(i = 0; i < e->arity; i++){
+			if(i > 0)
+				print(e->op == Tand ? " " : " : ");
 			if(e->op == Tand)
-				print(" ");
+				printsubexpr(e->tagls[i]);
 			else
-				print(" : ");
-			printexpr(e->tagls[i]);
+				printexpr(e->tagls[i]);
 		}
 		break;
 	default:
@@ -30,105 +125,314 @@ printexpr(Texpr* e)
 	}
 }
 
+static void
+flatvals(Vals* vals)
+{
+	if(vals->p == nil || vals->v != nil)
+		return;
+	vals->v = getvbuf(vals->p->n+Setpad, &vals->av);
+	vals->nv = postvals(vals->p, vals->v);
+}
+
+/* Values are printed as qids.
+ */
 void
 printexprval(Texpr* e)
 {
 	int	i;
 
+	flatvals(e->rval);
 	if(e->rval->nv != 0){
-		print("%llx", e->rval->v[0]);
+		print("%llx", docqid(e->docs, e->rval->v[0]));
 		for(i = 1; i < e->rval->nv; i++)
-			print(" %llx", e->rval->v[i]);
+			print(" %llx", docqid(e->docs, e->rval->v[i]));
 		print("\n");
 	}
 }
 
-char*
-smprintexprval(Texpr* e)
+/* The number of values in the result for e.
+ */
+int
+nexprval(Texpr* e)
 {
-	int	i;
-	static	char buf[64*1024];
-	char*	s;
+	flatvals(e->rval);
+	return e->rval->nv;
+}
 
-	s = buf;
-	*s = 0;
-	if(e->rval->nv != 0){
-		s = seprint(s, buf+sizeof(buf), "%llx", e->rval->v[0]);
-		for(i = 1; i < e->rval->nv; i++)
-			s = seprint(s, buf+sizeof(buf), " %llx", e->rval->v[i]);
-		seprint(s, buf+sizeof(buf), "\n");
+/* Read n bytes of the printed values at off into buf.
+ * Reads at increasing offsets resume at vp, the position
+ * of the last value read, and format only what they return.
+ */
+long
+readexprval(Texpr* e, Vpos* vp, vlong off, char* buf, long n)
+{
+	char	w[32];
+	Vals*	vals;
+	long	tot;
+	int	l, s, c;
+
+	vals = e->rval;
+	flatvals(vals);
+	if(off < vp->off){
+		vp->i = 0;
+		vp->off = 0;
+	}
+	for(tot = 0; vp->i < vals->nv && tot < n; vp->i++){
+		l = snprint(w, sizeof w, "%llx%c", docqid(e->docs, vals->v[vp->i]),
+			vp->i == vals->nv-1 ? '\n' : ' ');
+		if(vp->off + l <= off){
+			vp->off += l;
+			continue;
+		}
+		s = off + tot - vp->off;
+		c = l - s;
+		if(c > n - tot)
+			c = n - tot;
+		memmove(buf+tot, w+s, c);
+		tot += c;
+		if(s + c < l)
+			break;
+		vp->off += l;
 	}
-	return estrdup(buf);
+	return tot;
 }
 
+/*
+ * Expressions are compiled into a single block holding
+ * their nodes, the lists of operands, and the tags, so
+ * parsing allocates once and freeexpr frees it all.
+ * The root is the first node.
+ *
+ *	expr:	tagl [ ':' tagl ]...
+ *	tagl:	term [ term ]...
+ *	term:	tag | '!' term | '(' expr ')'
+ *
+ * Parens and ':' need not be separate tokens, and '!'
+ * is one only before a term.
+ */
+
+typedef struct Lex Lex;
+
+enum {
+	Lword = 1,	// a tag, other lexemes are their char
+};
+
+struct Lex {
+	char**	toks;
+	int	ntoks;
+	int	pos;	// in toks
+	char*	s;	// rest of toks[pos] to scan
+	int	tok;	// Lword, '(', ')', ':', '!', or 0 at the end
+	char*	w;	// the word, for Lword
+	int	nw;
+	int	n;	// # of lexemes seen
+	int	nchars;	// # of bytes for words
+	Texpr*	nodes;
+	int	nnodes;
+	Texpr**	ls;	// lists of operands
+	int	nls;
+	Texpr**	stk;	// operands for lists being parsed
+	int	nstk;
+	char*	text;	// for tags
+};
+
 static void
-addtagl(Texpr* e, Texpr* tl)
+lex(Lex* l)
 {
-	assert(e->op == Tor || e->op == Tand);
-	if((e->arity%Incr) == 0)
-		e->tagls = erealloc(e->tagls, (e->arity+Incr)*sizeof(Texpr));
-	e->tagls[e->arity++] = tl;
+	char*	s;
+
+	for(;;){
+		if(l->s == nil){
+			if(l->pos == l->ntoks){
+				l->tok = 0;
+				return;
+			}
+			l->s = l->toks[l->pos];
+		}
+		if(*l->s != 0)
+			break;
+		l->s = nil;
+		l->pos++;
+	}
+	l->n++;
+	s = l->s;
+	if(strchr("():!", *s) != nil){
+		l->tok = *s;
+		l->s++;
+		return;
+	}
+	for(l->w = s; *s != 0 && strchr("():", *s) == nil; s++)
+		;
+	l->nw = s - l->w;
+	l->nchars += l->nw + 1;
+	l->s = s;
+	l->tok = Lword;
+}
+
+static Texpr*
+synerr(char* msg)
+{
+	werrstr("%s", msg);
+	return nil;
 }
 
+/* A node for op, taking its n operands from the stack.
+ */
 static Texpr*
-parsetag(int ntoks, char* toks[], int* pos)
+newnode(Lex* l, int op, int n)
 {
 	Texpr*	e;
 
-	if(*pos == ntoks)
-		return nil;
-	if(strcmp(toks[*pos], ":") == 0)
-		sysfatal("tag expected");
-	e = emallocz(sizeof(Texpr), 1);
-	e->op = Ttag;
-	e->tag = estrdup(toks[*pos]);
-	(*pos)++;
+	e = &l->nodes[l->nnodes++];
+	e->op = op;
+	e->arity = n;
+	e->tagls = l->ls + l->nls;
+	memmove(e->tagls, l->stk + l->nstk - n, n*sizeof(Texpr*));
+	l->nls += n;
+	l->nstk -= n;
 	return e;
 }
 
+static Texpr*	pexpr(Lex* l);
+
 static Texpr*
-parsetagl(int ntoks, char* toks[], int* pos)
+pterm(Lex* l)
 {
-	Texpr*	re;
 	Texpr*	e;
 
-	if(*pos == ntoks)
-		return nil;
-	re = emallocz(sizeof(Texpr), 1);
-	re->op = Tand;
-	if(strcmp(toks[*pos], ":") == 0)
-		sysfatal("tag expected");
-	do {
-		e = parsetag(ntoks, toks, pos);
-		addtagl(re, e);
-	} while(*pos < ntoks && strcmp(toks[*pos],":") != 0);
-	return re;
+	switch(l->tok){
+	case Lword:
+		e = newnode(l, Ttag, 0);
+		e->tag = l->text;
+		memmove(l->text, l->w, l->nw);
+		l->text += l->nw + 1;
+		lex(l);
+		return e;
+	case '!':
+		lex(l);
+		e = pterm(l);
+		if(e == nil)
+			return nil;
+		if(e->op == Tnot)
+			return synerr("'!' after '!'");
+		l->stk[l->nstk++] = e;
+		return newnode(l, Tnot, 1);
+	case '(':
+		lex(l);
+		e = pexpr(l);
+		if(e == nil)
+			return nil;
+		if(l->tok != ')')
+			return synerr("')' expected");
+		lex(l);
+		return e;
+	}
+	return synerr("tag expected");
+}
+
+static Texpr*
+ptagl(Lex* l)
+{
+	Texpr*	e;
+	int	n, npos;
+
+	n = npos = 0;
+	while(l->tok == Lword || l->tok == '!' || l->tok == '('){
+		e = pterm(l);
+		if(e == nil)
+			return nil;
+		l->stk[l->nstk++] = e;
+		npos += e->op != Tnot;
+		n++;
+	}
+	if(n == 0)
+		return synerr("tag expected");
+	// no complements over all files.
+	if(npos == 0)
+		return synerr("negated tags need a tag");
+	return newnode(l, Tand, n);
 }
 
+static Texpr*
+pexpr(Lex* l)
+{
+	Texpr*	e;
+	int	n;
+
+	e = ptagl(l);
+	if(e == nil || l->tok != ':')
+		return e;
+	l->stk[l->nstk++] = e;
+	for(n = 1; l->tok == ':'; n++){
+		lex(l);
+		e = ptagl(l);
+		if(e == nil)
+			return nil;
+		l->stk[l->nstk++] = e;
+	}
+	return newnode(l, Tor, n);
+}
+
+/* An expression may start with "limit n" to ask
+ * for just the first n values, and with "rank k" to
+ * ask for the best k, best first. With both, the
+ * best of them are kept, up to n.
+ * Returns nil and sets the error string on errors.
+ */
 Texpr*
 parseexpr(int ntoks, char* toks[], int* pos)
 {
+	Lex	l;
 	Texpr*	e;
-	Texpr*	re;
+	int	limit, rank, nn;
+	int*	np;
+	char*	s;
 
-	e = parsetagl(ntoks, toks, pos);
-	if(e == nil)
+	limit = rank = 0;
+	while(ntoks - *pos > 2){
+		if(strcmp(toks[*pos], "limit") == 0)
+			np = &limit;
+		else if(strcmp(toks[*pos], "rank") == 0)
+			np = &rank;
+		else
+			break;
+		*np = strtol(toks[*pos+1], &s, 10);
+		if(*s != 0 || *np <= 0){
+			werrstr("bad %s", toks[*pos]);
+			return nil;
+		}
+		*pos += 2;
+	}
+	memset(&l, 0, sizeof l);
+	l.toks = toks;
+	l.ntoks = ntoks;
+	l.pos = *pos;
+	do
+		lex(&l);
+	while(l.tok != 0);
+	if(l.n == 0)
+		return synerr("no tags");
+	nn = 2*l.n + 4;
+	l.nodes = emallocz(nn*sizeof(Texpr) + 2*nn*sizeof(Texpr*) + l.nchars, 1);
+	l.ls = (Texpr**)(l.nodes + nn);
+	l.stk = l.ls + nn;
+	l.text = (char*)(l.stk + nn);
+	l.nnodes = 1;
+	l.pos = *pos;
+	lex(&l);
+	e = pexpr(&l);
+	if(e != nil && l.tok != 0)
+		e = synerr(l.tok == ')' ? "unexpected ')'" : "syntax error");
+	if(e == nil){
+		free(l.nodes);
 		return nil;
-	if(*pos == ntoks)
-		return e;
-	re = emallocz(sizeof(Texpr), 1);
-	re->op = Tor;
-	addtagl(re, e);
-	while(*pos < ntoks){
-		if(strcmp(toks[*pos], ":") != 0)
-			sysfatal("':' expected");
-		(*pos)++;
-		e = parsetagl(ntoks, toks, pos);
-		if(e == nil)
-			sysfatal("tag list expected");
-		addtagl(re, e);
 	}
-	return re;
+	l.nodes[0] = *e;
+	e = l.nodes;
+	e->limit = limit;
+	e->rank = rank;
+	*pos = l.pos;
+	return e;
 }
 
 static Vals*
@@ -140,140 +444,1046 @@ newvals(void)
 	return vals;
 }
 
-static Vals*
+/* A copy of vals, with the values decoded.
+ */
+Vals*
 dupvals(Vals* vals)
 {
 	Vals*	nv;
 
+	flatvals(vals);
 	nv = newvals();
 	*nv = *vals;
-	nv->v = emallocz(nv->av*sizeof(uvlong), 0);
-	memmove(nv->v, vals->v, nv->nv*sizeof(uvlong));
+	nv->p = nil;
+	nv->ownp = 0;
+	nv->v = getvbuf(nv->nv+Setpad, &nv->av);
+	memmove(nv->v, vals->v, nv->nv*sizeof(u32int));
 	return nv;
 }
 
+/* Keep just the first lim values, if lim > 0,
+ * decoding no more than needed.
+ */
 static void
-addvals(Vals* vals, Trie* t)
+cutvals(Vals* vals, int lim)
 {
-	int	i;
-
-	free(vals->v);
-	vals->av = t->nvals+t->nsvals+Incr;
-	vals->nv = t->nvals+t->nsvals;
-	vals->v = emallocz(vals->av*sizeof(uvlong), 0);
-	if(t->nvals)
-		memmove(vals->v, t->vals, t->nvals*sizeof(uvlong));
-	for(i = 0; i < t->nsvals; i++)
-		vals->v[t->nvals+i] = (uvlong)t->svals[i];
+	if(lim <= 0 || vals->nv <= lim)
+		return;
+	if(vals->v == nil && vals->p != nil){
+		vals->v = getvbuf(lim+2*Nblk+Setpad, &vals->av);
+		postfirst(vals->p, vals->v, lim);
+	}
+	if(vals->ownp){
+		freepost(nil, vals->p);
+		free(vals->p);
+		vals->ownp = 0;
+	}
+	vals->p = nil;
+	vals->nv = lim;
 }
 
+/* Values are decoded from t only if needed. Large
+ * sets are probed instead, and containers may be
+ * used by Tand and Tor as they are.
+ */
 static void
+addvals(Vals* vals, Trie* t)
+{
+	putvbuf(vals->v, vals->av);
+	vals->v = nil;
+	vals->p = &t->post;
+	vals->nv = t->post.n;
+}
+
+void
 freevals(Vals* vals)
 {
 	if(vals){
-		free(vals->v);
+		if(vals->ownp){
+			freepost(nil, vals->p);
+			free(vals->p);
+		}
+		putvbuf(vals->v, vals->av);
 		free(vals);
 	}
 }
 
-static int
-hasval(Vals* vals, uvlong v)
+/* Release the values for e and its operands.
+ */
+static void
+clearexpr(Texpr* e)
 {
 	int	i;
 
-	for(i = 0; i < vals->nv; i++)
-		if(vals->v[i] == v)
-			break;
-	return i < vals->nv;
+	for(i = 0; i < e->arity; i++)
+		clearexpr(e->tagls[i]);
+	freevals(e->rval);
+	e->rval = nil;
 }
 
-static void
-addval(Vals* vals, uvlong v)
+/*
+ * Vals are kept sorted, so Tand, Tor and Tnot merge them
+ * using the kernels in sets.c.
+ * When one of the sets is much smaller, its values are
+ * looked up in the other by galloping, or in the containers
+ * of the other if it has them.
+ */
+
+static Vals*
+valsn(int n)
 {
-	if(hasval(vals, v))
-		return;
-	if(vals->nv == vals->av){
-		vals->av += Incr;
-		vals->v = erealloc(vals->v, vals->av*sizeof(uvlong));
+	Vals*	vals;
+
+	vals = newvals();
+	vals->v = getvbuf(n+Setpad, &vals->av);
+	return vals;
+}
+
+/* first i >= lo with v[i] >= x, or n.
+ */
+static int
+gallop(u32int* v, int lo, int n, u32int x)
+{
+	int	hi, m, step;
+
+	hi = lo;
+	for(step = 1; hi < n && v[hi] < x; step *= 2){
+		lo = hi + 1;
+		hi += step;
+	}
+	if(hi > n)
+		hi = n;
+	while(lo < hi){
+		m = lo + (hi - lo)/2;
+		if(v[m] < x)
+			lo = m + 1;
+		else
+			hi = m;
 	}
-	vals->v[vals->nv++] = v;
+	return lo;
 }
 
-static void
-delval(Vals* vals, uvlong v)
+static int
+isconts(Vals* vals)
 {
-	int	i;
-	int	nv;
+	return vals->p != nil && vals->p->roar;
+}
 
-	nv = vals->nv;
-	for(i = 0; i < nv; i++)
-		if(vals->v[i] == v){
-			vals->v[i] = vals->v[nv-1];
-			vals->nv--;
-			break;
+/* Tand or Tor for sets kept in containers,
+ * without decoding them.
+ */
+static Vals*
+contvals(int op, Vals* x, Vals* y)
+{
+	Vals*	r;
+
+	r = newvals();
+	r->p = emallocz(sizeof(Post), 1);
+	r->ownp = 1;
+	if(op == Tand)
+		postand(nil, r->p, x->p, y->p);
+	else
+		postor(nil, r->p, x->p, y->p);
+	r->nv = r->p->n;
+	return r;
+}
+
+static Vals*
+andvals(Vals* x, Vals* y)
+{
+	Vals*	r;
+	Vals*	t;
+	int	i, j;
+
+	if(x->nv > y->nv){
+		t = x;
+		x = y;
+		y = t;
+	}
+	// probing blocks decodes one of them each time.
+	if(y->v == nil && y->p != nil && x->nv*(y->p->roar ? Gallop : 2*Nblk) < y->nv){
+		flatvals(x);
+		r = valsn(x->nv);
+		for(i = 0; i < x->nv; i++)
+			if(posthas(y->p, x->v[i]))
+				r->v[r->nv++] = x->v[i];
+		return r;
+	}
+	if(isconts(x) && isconts(y))
+		return contvals(Tand, x, y);
+	flatvals(x);
+	flatvals(y);
+	r = valsn(x->nv);
+	if(x->nv*Gallop < y->nv){
+		j = 0;
+		for(i = 0; i < x->nv; i++){
+			j = gallop(y->v, j, y->nv, x->v[i]);
+			if(j == y->nv)
+				break;
+			if(y->v[j] == x->v[i])
+				r->v[r->nv++] = x->v[i];
 		}
+		return r;
+	}
+	r->nv = isect32(x->v, x->nv, y->v, y->nv, r->v);
+	return r;
 }
 
-void
-evalexpr(Trie* t, Texpr* e)
+/* Values in x and not in y, for Tnot within Tand.
+ * x is usually the smaller one, and y is searched
+ * like in andvals.
+ */
+static Vals*
+notvals(Vals* x, Vals* y)
 {
+	Vals*	r;
 	int	i, j;
+
+	if(y->v == nil && y->p != nil && x->nv*(y->p->roar ? Gallop : 2*Nblk) < y->nv){
+		flatvals(x);
+		r = valsn(x->nv);
+		for(i = 0; i < x->nv; i++)
+			if(!posthas(y->p, x->v[i]))
+				r->v[r->nv++] = x->v[i];
+		return r;
+	}
+	flatvals(x);
+	flatvals(y);
+	r = valsn(x->nv);
+	if(x->nv*Gallop < y->nv){
+		j = 0;
+		for(i = 0; i < x->nv; i++){
+			j = gallop(y->v, j, y->nv, x->v[i]);
+			if(j == y->nv || y->v[j] != x->v[i])
+				r->v[r->nv++] = x->v[i];
+		}
+		return r;
+	}
+	r->nv = diff32(x->v, x->nv, y->v, y->nv, r->v);
+	return r;
+}
+
+/* Tand for the first lim values of the operands of e.
+ * The smallest is decoded in growing prefixes, and its
+ * values searched in the others, until there are enough.
+ * Values found in Tnot operands are dropped.
+ */
+static Vals*
+andlim(Texpr* e, int lim)
+{
+	Vals*	r;
+	Vals*	x;
+	Vals*	y;
+	u32int*	v;
+	int*	js;
+	int	i, k, n, nk, av, yi, in, neg;
+
+	x = e->tagls[0]->rval;
+	for(yi = 1; yi < e->arity; yi++)
+		if(e->tagls[yi]->op != Tnot && e->tagls[yi]->rval->nv < x->nv)
+			x = e->tagls[yi]->rval;
+	for(yi = 0; yi < e->arity; yi++){
+		y = e->tagls[yi]->rval;
+		if(y != x && y->v == nil && y->p != nil && !y->p->roar)
+			flatvals(y);
+	}
+	js = emallocz(e->arity*sizeof(int), 1);
+	r = valsn(lim);
+	v = nil;
+	i = n = av = 0;
+	for(nk = Limitk*lim; r->nv < lim && i < x->nv; nk *= 2){
+		if(x->v != nil){
+			v = x->v;
+			n = nk < x->nv ? nk : x->nv;
+		} else {
+			putvbuf(v, av);
+			v = getvbuf(nk+2*Nblk, &av);
+			n = postfirst(x->p, v, nk);
+		}
+		for(; i < n && r->nv < lim; i++){
+			for(yi = 0; yi < e->arity; yi++){
+				y = e->tagls[yi]->rval;
+				if(y == x)
+					continue;
+				neg = e->tagls[yi]->op == Tnot;
+				if(y->v == nil)
+					in = y->p != nil && posthas(y->p, v[i]);
+				else {
+					k = js[yi] = gallop(y->v, js[yi], y->nv, v[i]);
+					if(k == y->nv && !neg)
+						i = x->nv;
+					in = k < y->nv && y->v[k] == v[i];
+				}
+				if(in == neg)
+					break;
+			}
+			if(yi == e->arity)
+				r->v[r->nv++] = v[i];
+		}
+	}
+	if(v != x->v)
+		putvbuf(v, av);
+	free(js);
+	return r;
+}
+
+/* Tor for the first lim values, if lim > 0.
+ * Each operand adds at most its first lim values.
+ */
+static Vals*
+orvals(Vals* x, Vals* y, int lim)
+{
+	Vals*	r;
+
+	if(lim > 0){
+		cutvals(x, lim);
+		cutvals(y, lim);
+	} else if(isconts(x) && isconts(y))
+		return contvals(Tor, x, y);
+	flatvals(x);
+	flatvals(y);
+	r = valsn(x->nv + y->nv);
+	r->nv = union32(x->v, x->nv, y->v, y->nv, r->v);
+	cutvals(r, lim);
+	return r;
+}
+
+static void
+addimgvals(Vals* vals, Timg* im, vlong off)
+{
+	putvbuf(vals->v, vals->av);
+	vals->nv = imgvals(im, off, nil);
+	vals->v = getvbuf(vals->nv+Setpad, &vals->av);
+	vals->nv = imgvals(im, off, vals->v);
+}
+
+/*
+ * Planning looks up the size of the values for tags,
+ * so Tand evaluates its operands smallest first and
+ * stops once the result is empty. Tnot operands go
+ * after the others, when there is less left to remove
+ * values from, and are dropped if empty. Tor drops branches
+ * known to be empty, and those with the tags of another
+ * branch and more, as they add nothing.
+ */
+
+/* The node for tag in t, or nil with *offp set to
+ * its offset in *imp (or -1) when searching the image,
+ * which is t's if t has the node not loaded.
+ * Nodes are not loaded, so versions may be searched at once.
+ */
+static Trie*
+looktag(Trie* t, Timg** imp, char* tag, vlong* offp)
+{
 	Trie*	tt;
-	Texpr*	ie;
 
+	if(*imp != nil){
+		*offp = imgget(*imp, tag);
+		return nil;
+	}
+	tt = triefind(t, tag, offp);
+	if(*offp >= 0)
+		*imp = t->img;
+	return tt;
+}
+
+static int
+tagcost(Trie* t, Timg* im, char* tag)
+{
+	Trie*	tt;
+	vlong	off;
+
+	tt = looktag(t, &im, tag, &off);
+	if(tt != nil)
+		return tt->post.n;
+	if(off < 0)
+		return 0;
+	return imgvals(im, off, nil);
+}
+
+static int
+costcmp(const void* a1, const void* a2)
+{
+	Texpr* const* e1 = a1;
+	Texpr* const* e2 = a2;
+	int	n1, n2;
+
+	n1 = (*e1)->op == Tnot;
+	n2 = (*e2)->op == Tnot;
+	if(n1 != n2)
+		return n1 - n2;
+	if(n1)
+		return (*e2)->cost - (*e1)->cost;
+	return (*e1)->cost - (*e2)->cost;
+}
+
+static int
+hastag(Texpr* e, char* tag)
+{
+	int	i;
+
+	if(e->op == Ttag)
+		return strcmp(e->tag, tag) == 0;
+	if(e->op != Tand)
+		return 0;
 	for(i = 0; i < e->arity; i++)
-		evalexpr(t, e->tagls[i]);
+		if(e->tagls[i]->op == Ttag && strcmp(e->tagls[i]->tag, tag) == 0)
+			return 1;
+	return 0;
+}
+
+/* Is e1 a Tand for the tags in e2 and maybe others?
+ */
+static int
+subsumed(Texpr* e1, Texpr* e2)
+{
+	int	i;
+
+	if(e2->op == Ttag)
+		return hastag(e1, e2->tag);
+	if(e2->op != Tand)
+		return 0;
+	for(i = 0; i < e2->arity; i++)
+		if(e2->tagls[i]->op != Ttag || !hastag(e1, e2->tagls[i]->tag))
+			return 0;
+	return 1;
+}
+
+static void
+dropexpr(Texpr* e, int i)
+{
+	clearexpr(e->tagls[i]);
+	memmove(e->tagls+i, e->tagls+i+1, (e->arity-i-1)*sizeof(Texpr*));
+	e->arity--;
+}
+
+static void
+planexpr(Trie* t, Timg* im, Texpr* e)
+{
+	int	i, j;
+
+	for(i = 0; i < e->arity; i++)
+		planexpr(t, im, e->tagls[i]);
 	switch(e->op){
 	case Ttag:
-		e->rval = newvals();
-		tt = trieget(t, e->tag);
-		if(tt != nil)
-			addvals(e->rval, tt);
+		e->cost = tagcost(t, im, e->tag);
+		break;
+	case Tnot:
+		e->cost = e->tagls[0]->cost;
 		break;
 	case Tand:
-		e->rval = dupvals(e->tagls[0]->rval);
-		for(i = 1; i < e->arity; i++){
-			ie = e->tagls[i];
-			for(j = 0; j < e->rval->nv;)
-				if(!hasval(ie->rval, e->rval->v[j]))
-					delval(e->rval, e->rval->v[j]);
-				else
-					j++;
-		}
+		for(i = 0; i < e->arity; i++)
+			for(j = i+1; j < e->arity; j++)
+				if(e->tagls[j]->op == Ttag && hastag(e->tagls[i], e->tagls[j]->tag))
+					dropexpr(e, j--);
+		for(i = 0; i < e->arity; i++)
+			if(e->tagls[i]->op == Tnot && e->tagls[i]->cost == 0)
+				dropexpr(e, i--);
+		qsort(e->tagls, e->arity, sizeof(Texpr*), costcmp);
+		e->cost = e->tagls[0]->cost;
 		break;
 	case Tor:
-		e->rval = dupvals(e->tagls[0]->rval);
-		for(i = 1; i < e->arity; i++){
-			ie = e->tagls[i];
-			for(j = 0; j < ie->rval->nv; j++)
-				addval(e->rval, ie->rval->v[j]);
+		for(i = 0; i < e->arity; i++){
+			if(e->tagls[i]->cost == 0){
+				dropexpr(e, i--);
+				continue;
+			}
+			for(j = 0; j < e->arity; j++)
+				if(j != i && subsumed(e->tagls[i], e->tagls[j])){
+					dropexpr(e, i--);
+					break;
+				}
 		}
+		e->cost = 0;
+		for(i = 0; i < e->arity; i++)
+			e->cost += e->tagls[i]->cost;
 		break;
 	default:
-		sysfatal("evalexpr: bad op %d", e->op);
+		sysfatal("planexpr: bad op %d", e->op);
 	}
 }
 
-void
-freeexpr(Texpr* e)
+/*
+ * Queries evaluated in a batch share the results for
+ * tags and sub-expressions used more than once in it.
+ * They are kept in a hash table by exprkey, once
+ * evaluated in full, and copied to other uses. Values
+ * still in the trie are shared without copying them.
+ */
+
+typedef struct Memo Memo;
+
+struct Memo {
+	char*	key;
+	int	n;	// # of uses in the batch
+	Vals*	vals;	// nil until evaluated
+	Memo*	next;
+};
+
+static char*
+memokey(Texpr* e)
+{
+	char*	key;
+	int	limit, rank;
+
+	limit = e->limit;
+	rank = e->rank;
+	e->limit = e->rank = 0;
+	key = exprkey(e);
+	e->limit = limit;
+	e->rank = rank;
+	return key;
+}
+
+static Memo*
+memolook(Memo** tab, char* key, int add)
+{
+	Memo*	m;
+	uint	h;
+	char*	s;
+
+	h = 0;
+	for(s = key; *s != 0; s++)
+		h = h*31 + (uchar)*s;
+	h %= Nmemo;
+	for(m = tab[h]; m != nil; m = m->next)
+		if(strcmp(m->key, key) == 0)
+			return m;
+	if(!add)
+		return nil;
+	m = emallocz(sizeof *m, 1);
+	m->key = estrdup(key);
+	m->next = tab[h];
+	tab[h] = m;
+	return m;
+}
+
+/* Operands of Tnot, and Tand or Tor with a single
+ * operand, share the results of their operands instead.
+ */
+static int
+memoable(Texpr* e)
+{
+	return e->op == Ttag || e->arity > 1;
+}
+
+static void
+memocount(Memo** tab, Texpr* e)
 {
 	int	i;
+	char*	key;
 
-	if(e == nil)
+	for(i = 0; i < e->arity; i++)
+		memocount(tab, e->tagls[i]);
+	if(!memoable(e))
 		return;
+	key = memokey(e);
+	memolook(tab, key, 1)->n++;
+	free(key);
+}
+
+static void
+freememo(Memo** tab)
+{
+	Memo*	m;
+	int	i;
+
+	for(i = 0; i < Nmemo; i++)
+		while((m = tab[i]) != nil){
+			tab[i] = m->next;
+			free(m->key);
+			freevals(m->vals);
+			free(m);
+		}
+	free(tab);
+}
+
+static Vals*
+sharevals(Vals* vals)
+{
+	Vals*	nv;
+
+	if(vals->v != nil || vals->p == nil || vals->ownp)
+		return dupvals(vals);
+	nv = newvals();
+	nv->p = vals->p;
+	nv->nv = vals->nv;
+	return nv;
+}
+
+/* Either t or im is used to lookup tags.
+ * Only the first lim values are needed, if lim > 0:
+ * Tor needs no more from each operand, and Tand
+ * stops searching its operands once it has that many.
+ * Results are shared through memo, if not nil.
+ */
+static void
+_evalexpr(Trie* t, Timg* im, Texpr* e, int lim, Memo** memo)
+{
+	int	i;
+	Trie*	tt;
+	vlong	off;
+	Texpr*	ie;
+	Vals*	rval;
+	Vals*	r;
+	Memo*	m;
+	char*	key;
+	Timg*	tim;
+
+	m = nil;
+	if(memo != nil && memoable(e)){
+		key = memokey(e);
+		m = memolook(memo, key, 0);
+		free(key);
+		if(m != nil && m->vals != nil){
+			e->rval = sharevals(m->vals);
+			cutvals(e->rval, lim);
+			return;
+		}
+		// only full results used again are kept.
+		if(m != nil && (m->n < 2 || lim > 0))
+			m = nil;
+	}
 	switch(e->op){
 	case Ttag:
-		free(e->tag);
+		e->rval = newvals();
+		tim = im;
+		tt = looktag(t, &tim, e->tag, &off);
+		if(tt != nil)
+			addvals(e->rval, tt);
+		else if(off >= 0)
+			addimgvals(e->rval, tim, off);
 		break;
+	case Tnot:
+		// the values to remove; see Tand.
+		ie = e->tagls[0];
+		_evalexpr(t, im, ie, 0, memo);
+		e->rval = ie->rval;
+		ie->rval = nil;
+		return;
 	case Tand:
 	case Tor:
-		for(i = 1; i < e->arity; i++)
-			freeexpr(e->tagls[i]);
+		if(e->op == Tand && lim > 0 && e->arity > 1){
+			for(i = 0; i < e->arity; i++){
+				ie = e->tagls[i];
+				if(ie->cost == 0 && ie->op != Tnot){
+					e->rval = newvals();
+					return;
+				}
+				_evalexpr(t, im, ie, 0, memo);
+				if(ie->rval->nv == 0 && ie->op != Tnot){
+					e->rval = newvals();
+					return;
+				}
+			}
+			e->rval = andlim(e, lim);
+			for(i = 0; i < e->arity; i++){
+				freevals(e->tagls[i]->rval);
+				e->tagls[i]->rval = nil;
+			}
+			return;
+		}
+		/* operand values are released once merged,
+		 * so their buffers are reused for the next ones.
+		 */
+		rval = nil;
+		for(i = 0; i < e->arity; i++){
+			ie = e->tagls[i];
+			if(e->op == Tand && (ie->cost == 0 && ie->op != Tnot || rval != nil && rval->nv == 0)){
+				freevals(rval);
+				e->rval = newvals();
+				return;
+			}
+			_evalexpr(t, im, ie, e->op == Tor || e->arity == 1 ? lim : 0, memo);
+			r = ie->rval;
+			ie->rval = nil;
+			if(rval == nil){
+				rval = r;
+				continue;
+			}
+			if(e->op == Tor)
+				e->rval = orvals(rval, r, lim);
+			else if(ie->op == Tnot)
+				e->rval = notvals(rval, r);
+			else
+				e->rval = andvals(rval, r);
+			freevals(rval);
+			freevals(r);
+			rval = e->rval;
+		}
+		e->rval = rval;
+		if(e->rval == nil)
+			e->rval = newvals();
 		break;
 	default:
-		sysfatal("bad op");
+		sysfatal("evalexpr: bad op %d", e->op);
+	}
+	if(m != nil)
+		m->vals = sharevals(e->rval);
+	cutvals(e->rval, lim);
+}
+
+/*
+ * Ranking scores values by the tags in the expression
+ * they have, BM25 style: tags found in fewer files weigh
+ * more, and so do tags found more times in the file, with
+ * diminishing returns. There are no file lengths to
+ * normalize for. A heap keeps the best k values.
+ */
+
+typedef struct Rterm Rterm;
+typedef struct Rval Rval;
+
+struct Rterm {
+	u32int*	v;	// values for the tag
+	int	nv;
+	int	i;	// where the last search stopped
+	Pfreq*	f;	// their counts
+	Pfreq	imgf;	// for counts from an image
+	double	idf;
+};
+
+struct Rval {
+	double	score;
+	u32int	v;
+};
+
+static double K1 = 1.2;	// tf saturation
+
+static int
+nleaves(Texpr* e)
+{
+	int	i, n;
+
+	if(e->op == Ttag)
+		return 1;
+	n = 0;
+	for(i = 0; i < e->arity; i++)
+		n += nleaves(e->tagls[i]);
+	return n;
+}
+
+/* Adds to ks the keys for tags in e not there.
+ */
+static int
+rankkeys(Texpr* e, char** ks, int nk)
+{
+	char*	k;
+	int	i;
+
+	if(e->op == Tnot)
+		return nk;
+	if(e->op != Ttag){
+		for(i = 0; i < e->arity; i++)
+			nk = rankkeys(e->tagls[i], ks, nk);
+		return nk;
 	}
+	k = tagkey(e->tag);
+	for(i = 0; i < nk; i++)
+		if(strcmp(ks[i], k) == 0){
+			free(k);
+			return nk;
+		}
+	ks[nk++] = k;
+	return nk;
+}
+
+static int
+worse(Rval* x, Rval* y)
+{
+	if(x->score != y->score)
+		return x->score < y->score;
+	return x->v > y->v;
+}
+
+static void
+heapup(Rval* h, int i)
+{
+	Rval	x;
+	int	p;
+
+	x = h[i];
+	for(; i > 0 && worse(&x, &h[p = (i-1)/2]); i = p)
+		h[i] = h[p];
+	h[i] = x;
+}
+
+static void
+heapdown(Rval* h, int n, int i)
+{
+	Rval	x;
+	int	c;
+
+	x = h[i];
+	for(; (c = 2*i+1) < n; i = c){
+		if(c+1 < n && worse(&h[c+1], &h[c]))
+			c++;
+		if(!worse(&h[c], &x))
+			break;
+		h[i] = h[c];
+	}
+	h[i] = x;
+}
+
+static void
+termvals(Trie* t, Timg* im, char* k, Rterm* rt)
+{
+	Trie*	tt;
+	vlong	off;
+
+	rt->f = &rt->imgf;
+	tt = looktag(t, &im, k, &off);
+	if(tt == nil){
+		if(off < 0)
+			return;
+		rt->v = emallocz((imgvals(im, off, nil)+1)*sizeof(u32int), 0);
+		rt->nv = imgvals(im, off, rt->v);
+		imgfreq(im, off, &rt->imgf);
+		return;
+	}
+	rt->v = emallocz((tt->post.n+1)*sizeof(u32int), 0);
+	rt->nv = postvals(&tt->post, rt->v);
+	rt->f = &tt->freq;
+}
+
+/* Keep the best e->rank values of the result,
+ * or e->limit if fewer.
+ */
+static void
+rankexpr(Trie* t, Timg* im, Texpr* e)
+{
+	Vals*	vals;
+	Rterm*	ts;
+	Rterm*	rt;
+	Rval*	h;
+	Rval	x;
+	char**	ks;
+	int	nt, nh, k, i, j;
+	double	n, tf;
+
+	vals = e->rval;
+	flatvals(vals);
+	ks = emallocz(nleaves(e)*sizeof(char*), 0);
+	nt = rankkeys(e, ks, 0);
+	ts = emallocz(nt*sizeof(Rterm), 1);
+	n = im != nil ? im->docs->n : t->docs->n;
+	for(i = 0; i < nt; i++){
+		termvals(t, im, ks[i], &ts[i]);
+		ts[i].idf = log(1 + (n - ts[i].nv + 0.5)/(ts[i].nv + 0.5));
+	}
+	k = e->rank < vals->nv ? e->rank : vals->nv;
+	if(e->limit > 0 && e->limit < k)
+		k = e->limit;
+	h = emallocz((k+1)*sizeof(Rval), 0);
+	nh = 0;
+	for(j = 0; j < vals->nv; j++){
+		x.v = vals->v[j];
+		x.score = 0;
+		for(i = 0; i < nt; i++){
+			rt = &ts[i];
+			rt->i = gallop(rt->v, rt->i, rt->nv, x.v);
+			if(rt->i < rt->nv && rt->v[rt->i] == x.v){
+				tf = freqget(rt->f, x.v);
+				x.score += rt->idf * tf*(K1+1)/(tf+K1);
+			}
+		}
+		if(nh < k){
+			h[nh] = x;
+			heapup(h, nh++);
+		} else if(k > 0 && worse(&h[0], &x)){
+			h[0] = x;
+			heapdown(h, nh, 0);
+		}
+	}
+	freevals(e->rval);
+	e->rval = valsn(nh);
+	e->rval->nv = nh;
+	for(; nh > 0; nh--){
+		e->rval->v[nh-1] = h[0].v;
+		h[0] = h[nh-1];
+		heapdown(h, nh-1, 0);
+	}
+	for(i = 0; i < nt; i++){
+		free(ks[i]);
+		free(ts[i].v);
+		freefreq(nil, &ts[i].imgf);
+	}
+	free(ks);
+	free(ts);
+	free(h);
+}
+
+/* With a rank, all values are needed to find the best ones.
+ */
+static void
+_evalbatch(Trie* t, Timg* im, Texpr** es, int n)
+{
+	Memo**	memo;
+	Texpr*	e;
+	int	i;
+
+	setsinit();
+	memo = nil;
+	if(n > 1)
+		memo = emallocz(Nmemo*sizeof(Memo*), 1);
+	for(i = 0; i < n; i++){
+		planexpr(t, im, es[i]);
+		if(memo != nil)
+			memocount(memo, es[i]);
+	}
+	for(i = 0; i < n; i++){
+		e = es[i];
+		_evalexpr(t, im, e, e->rank > 0 ? 0 : e->limit, memo);
+		if(e->rank > 0)
+			rankexpr(t, im, e);
+		e->docs = im != nil ? im->docs : t->docs;
+	}
+	if(memo != nil)
+		freememo(memo);
+}
+
+void
+evalexpr(Trie* t, Texpr* e)
+{
+	_evalbatch(t, nil, &e, 1);
+}
+
+/* Evaluate e searching the database image in place.
+ */
+void
+evalimg(Timg* im, Texpr* e)
+{
+	_evalbatch(nil, im, &e, 1);
+}
+
+/* Evaluate the n queries in es at once, sharing
+ * the values they have in common.
+ */
+void
+evalbatch(Trie* t, Texpr** es, int n)
+{
+	_evalbatch(t, nil, es, n);
+}
+
+void
+evalimgbatch(Timg* im, Texpr** es, int n)
+{
+	_evalbatch(nil, im, es, n);
+}
+
+/* Set the result for e to a copy of vals,
+ * as if e was evaluated with docs.
+ */
+void
+setexprval(Texpr* e, Vals* vals, Docs* docs)
+{
 	freevals(e->rval);
+	e->rval = dupvals(vals);
+	e->docs = docs;
+}
+
+/* The tag s, as kept in keys.
+ */
+char*
+tagkey(char* s)
+{
+	char*	l;
+	char*	p;
+	Rune	r;
+
+	l = emallocz(utflen(s)*UTFmax + 1, 0);
+	for(p = l; *s != 0; ){
+		s += chartorune(&r, s);
+		r = tolowerrune(r);
+		p += runetochar(p, &r);
+	}
+	*p = 0;
+	return l;
+}
+
+static int
+keycmp(const void* a1, const void* a2)
+{
+	char* const* k1 = a1;
+	char* const* k2 = a2;
+
+	return strcmp(*k1, *k2);
+}
+
+/* A key for e, the same for expressions with the same
+ * values: tags are lower case, and operands are sorted
+ * without repeating them.
+ */
+char*
+exprkey(Texpr* e)
+{
+	char**	ks;
+	char*	s;
+	char*	p;
+	char*	sep;
+	int	i, n, l;
+
+	if(e->op == Ttag)
+		return tagkey(e->tag);
+	if(e->op == Tnot){
+		p = exprkey(e->tagls[0]);
+		if(e->tagls[0]->op == Ttag)
+			s = smprint("!%s", p);
+		else
+			s = smprint("!(%s)", p);
+		free(p);
+		return s;
+	}
+	ks = emallocz(e->arity*sizeof(char*), 0);
+	for(i = n = 0; i < e->arity; i++){
+		ks[n] = exprkey(e->tagls[i]);
+		if(e->op == Tand && e->tagls[i]->op == Tor){
+			p = smprint("(%s)", ks[n]);
+			free(ks[n]);
+			ks[n] = p;
+		}
+		n++;
+	}
+	qsort(ks, n, sizeof(char*), keycmp);
+	sep = e->op == Tand ? " " : " : ";
+	l = 1;
+	for(i = 0; i < n; i++)
+		l += strlen(ks[i]) + strlen(sep);
+	s = emallocz(l, 0);
+	p = s;
+	*p = 0;
+	for(i = 0; i < n; i++){
+		if(i > 0 && strcmp(ks[i], ks[i-1]) == 0)
+			continue;
+		if(p != s)
+			p = strecpy(p, s+l, sep);
+		p = strecpy(p, s+l, ks[i]);
+	}
+	for(i = 0; i < n; i++)
+		free(ks[i]);
+	free(ks);
+	if(e->limit > 0){
+		p = smprint("limit %d %s", e->limit, s);
+		free(s);
+		s = p;
+	}
+	if(e->rank > 0){
+		p = smprint("rank %d %s", e->rank, s);
+		free(s);
+		s = p;
+	}
+	return s;
+}
+
+/* e must be the root from parseexpr.
+ * The nodes go with it.
+ */
+void
+freeexpr(Texpr* e)
+{
+	if(e == nil)
+		return;
+	clearexpr(e);
 	free(e);
 }
 
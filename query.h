@@ -4,31 +4,63 @@ enum {
 	Ttag,
 	Tand,
 	Tor,
+	Tnot,	// within Tand, values not in the operand
+
+	Gallop = 32,	// search instead of merging sets this skewed
+	Limitk = 4,	// Tand with a limit decodes Limitk*limit values first
+	Npool = 32,	// value buffers kept for reuse
+	Poolmax = 1024*1024,	// and the most values in one
+	Nmemo = 256,	// hash buckets for results shared in a batch
 };
 
 typedef struct Vals Vals;
 typedef struct Texpr Texpr;
+typedef struct Vpos Vpos;
 
+/* Values are doc ids; see docs.h
+ */
 struct Vals {
-	uvlong*	v;
+	u32int*	v;
 	int	nv;
 	int	av;	// allocated vs
+	Post*	p;	// values in containers, v is set by flatvals
+	int	ownp;	// p is freed with the vals
 };
 
 struct Texpr {
 	int	op;
 	int	arity;
 	Vals*	rval;	// result value
+	int	cost;	// # of values expected, by planning
+	Docs*	docs;	// to print rval, set by evalexpr
+	int	limit;	// if > 0, evaluate only the first values
+	int	rank;	// if > 0, keep the best values, best first
 	union {
 		char*	tag;	// Ttag 
-		Texpr**	tagls;	// Tand, Tor
+		Texpr**	tagls;	// Tand, Tor, Tnot
 	};
 };
 
+/* Where a reader is within the printed values
+ */
+struct Vpos {
+	int	i;	// next value
+	vlong	off;	// where it is printed
+};
+
 void		printexpr(Texpr* e);
 void		printexprval(Texpr* e);
-char*		smprintexprval(Texpr* e);
+long		readexprval(Texpr* e, Vpos* vp, vlong off, char* buf, long n);
+int		nexprval(Texpr* e);
 void		evalexpr(Trie* t, Texpr* e);
+void		evalimg(Timg* im, Texpr* e);
+void		evalbatch(Trie* t, Texpr** es, int n);
+void		evalimgbatch(Timg* im, Texpr** es, int n);
 void		freeexpr(Texpr* e);
+char*		exprkey(Texpr* e);
+char*		tagkey(char* tag);
+void		setexprval(Texpr* e, Vals* vals, Docs* docs);
+Vals*		dupvals(Vals* vals);
+void		freevals(Vals* vals);
 Texpr*		parseexpr(int ntoks, char* toks[], int* pos);
 
@@ -1,6 +1,9 @@
 #include <u.h>
 #include <libc.h>
 #include <bio.h>
+#include "arena.h"
+#include "post.h"
+#include "docs.h"
 #include "trie.h"
 #include "util.h"
 #include "query.h"
@@ -8,25 +11,83 @@
 void
 usage(void)
 {
-	fprint(2, "usage: %s trie [tag...]\n", argv0);
+	fprint(2, "usage: %s [-b] trie [[limit n] [rank k] tag...]\n", argv0);
 	exits("usage");
 }
 
+/* Read queries from standard input, one per line,
+ * and evaluate them as a batch. Each one prints a
+ * line with its values.
+ */
+static void
+batch(Trie* t, Timg* im)
+{
+	Biobuf	bin;
+	Texpr**	es;
+	char*	toks[512];
+	char*	ln;
+	int	i, n, ntoks, pos;
+
+	Binit(&bin, 0, OREAD);
+	es = nil;
+	for(n = 0; (ln = Brdstr(&bin, '\n', 1)) != nil; n++){
+		ntoks = tokenize(ln, toks, nelem(toks));
+		pos = 0;
+		es = erealloc(es, (n+1)*sizeof(Texpr*));
+		es[n] = parseexpr(ntoks, toks, &pos);
+		if(es[n] == nil)
+			sysfatal("line %d: %r", n+1);
+		free(ln);
+	}
+	Bterm(&bin);
+	if(im != nil)
+		evalimgbatch(im, es, n);
+	else
+		evalbatch(t, es, n);
+	for(i = 0; i < n; i++){
+		if(nexprval(es[i]) == 0)
+			print("\n");
+		else
+			printexprval(es[i]);
+		freeexpr(es[i]);
+	}
+	free(es);
+}
+
 void
 main(int argc, char* argv[])
 {
 	Trie*	t;
+	Timg*	im;
 	Biobuf*	b;
 	Biobuf  bout;
-	int	pos;
+	int	pos, bflag;
 	Texpr*	e;
 
+	bflag = 0;
 	ARGBEGIN{
+	case 'b':
+		bflag = 1;
+		break;
 	default:
 		usage();
 	}ARGEND;
-	if(argc < 1)
+	if(argc < 1 || bflag && argc > 1)
 		usage();
+	if((argc > 1 || bflag) && (im = openimg(argv[0])) != nil){
+		if(bflag){
+			batch(nil, im);
+			exits(nil);
+		}
+		// binary database: search it in place.
+		pos = 0;
+		e = parseexpr(argc-1, argv+1, &pos);
+		if(e == nil)
+			sysfatal("%r");
+		evalimg(im, e);
+		printexprval(e);
+		exits(nil);
+	}
 	b = Bopen(argv[0], OREAD);
 	if(b == nil)
 		sysfatal("%s: %r", argv[0]);
@@ -35,11 +96,15 @@ main(int argc, char* argv[])
 		sysfatal("%s: %r", argv[0]);
 	Bterm(b);
 	Binit(&bout, 1, OWRITE);
-	if(argc == 1)
+	if(bflag)
+		batch(t, nil);
+	else if(argc == 1)
 		printtrie(&bout, t);
 	else {
 		pos = 0;
 		e = parseexpr(argc-1, argv+1, &pos);
+		if(e == nil)
+			sysfatal("%r");
 		evalexpr(t, e);
 		printexprval(e);
 		// freeexpr(e);		leak it
@@ -0,0 +1,91 @@
+#include <u.h>
+#include <libc.h>
+#include "util.h"
+#include "sets.h"
+
+/*
+ * Micro-benchmark for the set kernels, reporting
+ * elements per second for the scalar versions and
+ * those picked by setsinit for this machine.
+ */
+
+static void
+usage(void)
+{
+	fprint(2, "usage: %s [-n nelems] [-r rounds]\n", argv0);
+	exits("usage");
+}
+
+/* n sorted values, gap between 1 and 2*gap-1.
+ */
+static u32int*
+mkset(int n, int gap)
+{
+	u32int*	v;
+	u32int	x;
+	int	i;
+
+	v = emallocz((n+Setpad)*sizeof(u32int), 0);
+	x = 0;
+	for(i = 0; i < n; i++){
+		x += 1 + nrand(2*gap-1);
+		v[i] = x;
+	}
+	return v;
+}
+
+static void
+bench(char* what, int (*f)(u32int*, int, u32int*, int, u32int*),
+	u32int* a, int na, u32int* b, int nb, u32int* r, int rounds)
+{
+	vlong	t0, t;
+	int	i, n;
+
+	n = 0;
+	t0 = nsec();
+	for(i = 0; i < rounds; i++)
+		n = f(a, na, b, nb, r);
+	t = nsec() - t0;
+	if(t <= 0)
+		t = 1;
+	print("\t%-14s %8.1f Melem/s\t%d values\n", what, (double)(na+nb)*rounds*1000.0/t, n);
+}
+
+void
+main(int argc, char* argv[])
+{
+	static int gaps[][2] = {{1, 1}, {2, 2}, {4, 64}, {64, 64}};
+	u32int*	a;
+	u32int*	b;
+	u32int*	r;
+	int	n, rounds, i;
+
+	n = 1000000;
+	rounds = 20;
+	ARGBEGIN{
+	case 'n':
+		n = atoi(EARGF(usage()));
+		break;
+	case 'r':
+		rounds = atoi(EARGF(usage()));
+		break;
+	default:
+		usage();
+	}ARGEND;
+	if(argc != 0 || n <= 0 || rounds <= 0)
+		usage();
+	setsinit();
+	r = emallocz((2*n+Setpad)*sizeof(u32int), 0);
+	for(i = 0; i < nelem(gaps); i++){
+		a = mkset(n, gaps[i][0]);
+		b = mkset(n, gaps[i][1]);
+		print("%d values, gaps %d and %d:\n", n, gaps[i][0], gaps[i][1]);
+		bench("isect scalar", isect32scalar, a, n, b, n, r, rounds);
+		bench(smprint("isect %s", isectkind), isect32, a, n, b, n, r, rounds);
+		bench("union scalar", union32scalar, a, n, b, n, r, rounds);
+		bench(smprint("union %s", unionkind), union32, a, n, b, n, r, rounds);
+		free(a);
+		free(b);
+	}
+	exits(nil);
+}
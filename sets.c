@@ -0,0 +1,316 @@
+#include <u.h>
+#include <libc.h>
+#include "sets.h"
+#ifndef ONPLAN9
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SETSIMD
+#include <immintrin.h>
+#endif
+#endif
+
+/*
+ * Kernels for sorted sets of 32 bit values
+ * without duplicates. Results go to r, which must
+ * have room for the result plus Setpad values, as
+ * vector code stores whole registers.
+ * isect32 and union32 are set by setsinit to the
+ * best versions for this machine.
+ */
+
+int	(*isect32)(u32int*, int, u32int*, int, u32int*) = isect32scalar;
+int	(*union32)(u32int*, int, u32int*, int, u32int*) = union32scalar;
+char*	isectkind = "scalar";
+char*	unionkind = "scalar";
+
+int
+isect32scalar(u32int* a, int na, u32int* b, int nb, u32int* r)
+{
+	int	i, j, n;
+	u32int	x, y;
+
+	i = j = n = 0;
+	while(i < na && j < nb){
+		x = a[i];
+		y = b[j];
+		r[n] = x;
+		n += x == y;
+		i += x <= y;
+		j += y <= x;
+	}
+	return n;
+}
+
+int
+union32scalar(u32int* a, int na, u32int* b, int nb, u32int* r)
+{
+	int	i, j, n;
+	u32int	x, y;
+
+	i = j = n = 0;
+	while(i < na && j < nb){
+		x = a[i];
+		y = b[j];
+		if(x <= y){
+			r[n++] = x;
+			i++;
+			j += x == y;
+		} else {
+			r[n++] = y;
+			j++;
+		}
+	}
+	memmove(r+n, a+i, (na-i)*sizeof(u32int));
+	n += na - i;
+	memmove(r+n, b+j, (nb-j)*sizeof(u32int));
+	n += nb - j;
+	return n;
+}
+
+/* Values in a and not in b. Its use is skewed
+ * to a few and large bs, which do not pay for
+ * a vector version.
+ */
+int
+diff32(u32int* a, int na, u32int* b, int nb, u32int* r)
+{
+	int	i, j, n;
+	u32int	x, y;
+
+	i = j = n = 0;
+	while(i < na && j < nb){
+		x = a[i];
+		y = b[j];
+		r[n] = x;
+		n += x < y;
+		i += x <= y;
+		j += y <= x;
+	}
+	memmove(r+n, a+i, (na-i)*sizeof(u32int));
+	return n + na - i;
+}
+
+#ifdef SETSIMD
+
+/*
+ * Intersections compare a block from each set
+ * against all rotations of the other one, and pack
+ * the matches with a shuffle indexed by the mask of
+ * equal lanes. The block with the lower last value
+ * is consumed, both if they are equal.
+ * Unions merge blocks with a min/max network and
+ * drop values equal to the one before.
+ */
+
+static uchar	pack4[16][16];	// pshufb moving the lanes in mask first
+static u32int	pack8[256][8];	// vpermd for the same, 8 lanes
+
+static void
+mkpacks(void)
+{
+	int	m, l, k;
+
+	for(m = 0; m < 16; m++){
+		memset(pack4[m], 0x80, 16);
+		for(l = k = 0; l < 4; l++)
+			if(m & 1<<l){
+				pack4[m][4*k] = 4*l;
+				pack4[m][4*k+1] = 4*l+1;
+				pack4[m][4*k+2] = 4*l+2;
+				pack4[m][4*k+3] = 4*l+3;
+				k++;
+			}
+	}
+	for(m = 0; m < 256; m++){
+		memset(pack8[m], 0, sizeof pack8[m]);
+		for(l = k = 0; l < 8; l++)
+			if(m & 1<<l)
+				pack8[m][k++] = l;
+	}
+}
+
+__attribute__((target("sse4.1")))
+static int
+isect32sse(u32int* a, int na, u32int* b, int nb, u32int* r)
+{
+	int	i, j, n, m;
+	u32int	x, y;
+	__m128i	va, vb, eq;
+
+	i = j = n = 0;
+	while(i+4 <= na && j+4 <= nb){
+		va = _mm_loadu_si128((__m128i*)(a+i));
+		vb = _mm_loadu_si128((__m128i*)(b+j));
+		eq = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi32(va, vb),
+				_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0,3,2,1)))),
+			_mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1,0,3,2))),
+				_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2,1,0,3)))));
+		m = _mm_movemask_ps(_mm_castsi128_ps(eq));
+		_mm_storeu_si128((__m128i*)(r+n),
+			_mm_shuffle_epi8(va, _mm_loadu_si128((__m128i*)pack4[m])));
+		n += __builtin_popcount(m);
+		x = a[i+3];
+		y = b[j+3];
+		i += x <= y ? 4 : 0;
+		j += y <= x ? 4 : 0;
+	}
+	return n + isect32scalar(a+i, na-i, b+j, nb-j, r+n);
+}
+
+__attribute__((target("avx2")))
+static int
+isect32avx(u32int* a, int na, u32int* b, int nb, u32int* r)
+{
+	int	i, j, n, m, k;
+	u32int	x, y;
+	__m256i	va, vb, eq, rot;
+
+	i = j = n = 0;
+	rot = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+	while(i+8 <= na && j+8 <= nb){
+		va = _mm256_loadu_si256((__m256i*)(a+i));
+		vb = _mm256_loadu_si256((__m256i*)(b+j));
+		eq = _mm256_cmpeq_epi32(va, vb);
+		for(k = 1; k < 8; k++){
+			vb = _mm256_permutevar8x32_epi32(vb, rot);
+			eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(va, vb));
+		}
+		m = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+		_mm256_storeu_si256((__m256i*)(r+n),
+			_mm256_permutevar8x32_epi32(va, _mm256_loadu_si256((__m256i*)pack8[m])));
+		n += __builtin_popcount(m);
+		x = a[i+7];
+		y = b[j+7];
+		i += x <= y ? 8 : 0;
+		j += y <= x ? 8 : 0;
+	}
+	return n + isect32sse(a+i, na-i, b+j, nb-j, r+n);
+}
+
+/* lo gets the lower 4 values of x and y, hi the others,
+ * both sorted, for x and y sorted.
+ */
+__attribute__((target("sse4.1")))
+static void
+merge4(__m128i x, __m128i y, __m128i* lo, __m128i* hi)
+{
+	__m128i	t, l, h;
+	int	k;
+
+	t = _mm_min_epu32(x, y);
+	h = _mm_max_epu32(x, y);
+	for(k = 0; k < 3; k++){
+		t = _mm_alignr_epi8(t, t, 4);
+		l = _mm_min_epu32(t, h);
+		h = _mm_max_epu32(t, h);
+		t = l;
+	}
+	*lo = _mm_alignr_epi8(t, t, 4);
+	*hi = h;
+}
+
+/* store the values in v not equal to the ones before,
+ * the first one compared with the last in prev.
+ */
+__attribute__((target("sse4.1")))
+static int
+storeuniq(__m128i prev, __m128i v, u32int* r)
+{
+	int	m;
+
+	m = _mm_movemask_ps(_mm_castsi128_ps(
+		_mm_cmpeq_epi32(_mm_alignr_epi8(v, prev, 12), v)));
+	m = ~m & 15;
+	_mm_storeu_si128((__m128i*)r,
+		_mm_shuffle_epi8(v, _mm_loadu_si128((__m128i*)pack4[m])));
+	return __builtin_popcount(m);
+}
+
+__attribute__((target("sse4.1")))
+static int
+union32sse(u32int* a, int na, u32int* b, int nb, u32int* r)
+{
+	int	i, j, k, n;
+	u32int	pend[4];
+	u32int	x, last;
+	__m128i	v, lo, hi, prev;
+
+	if(na < 4 || nb < 4)
+		return union32scalar(a, na, b, nb, r);
+	merge4(_mm_loadu_si128((__m128i*)a), _mm_loadu_si128((__m128i*)b), &lo, &hi);
+	i = j = 4;
+	prev = _mm_set1_epi32((a[0] < b[0] ? a[0] : b[0]) - 1);
+	n = storeuniq(prev, lo, r);
+	prev = lo;
+	for(;;){
+		// take the block with the lowest head; hi
+		// holds values not above both heads.
+		if(i < na && (j == nb || a[i] <= b[j])){
+			if(i+4 > na)
+				break;
+			v = _mm_loadu_si128((__m128i*)(a+i));
+			i += 4;
+		} else if(j < nb){
+			if(j+4 > nb)
+				break;
+			v = _mm_loadu_si128((__m128i*)(b+j));
+			j += 4;
+		} else
+			break;
+		merge4(v, hi, &lo, &hi);
+		n += storeuniq(prev, lo, r+n);
+		prev = lo;
+	}
+	// merge what is left: hi, a[i:], and b[j:].
+	_mm_storeu_si128((__m128i*)pend, hi);
+	last = r[n-1];
+	k = 0;
+	while(k < 4 || i < na || j < nb){
+		x = ~0;
+		if(k < 4)
+			x = pend[k];
+		if(i < na && a[i] < x)
+			x = a[i];
+		if(j < nb && b[j] < x)
+			x = b[j];
+		if(k < 4 && pend[k] == x)
+			k++;
+		if(i < na && a[i] == x)
+			i++;
+		if(j < nb && b[j] == x)
+			j++;
+		if(x != last)
+			r[n++] = last = x;
+	}
+	return n;
+}
+
+void
+setsinit(void)
+{
+	static int done;
+
+	if(done)
+		return;
+	done = 1;
+	mkpacks();
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.1")){
+		isect32 = isect32sse;
+		union32 = union32sse;
+		isectkind = unionkind = "sse4.1";
+	}
+	if(__builtin_cpu_supports("avx2")){
+		isect32 = isect32avx;
+		isectkind = "avx2";
+	}
+}
+
+#else
+
+void
+setsinit(void)
+{
+}
+
+#endif
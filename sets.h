@@ -0,0 +1,13 @@
+enum {
+	Setpad = 8,	// room needed after results, see sets.c
+};
+
+int	isect32scalar(u32int* a, int na, u32int* b, int nb, u32int* r);
+int	union32scalar(u32int* a, int na, u32int* b, int nb, u32int* r);
+int	diff32(u32int* a, int na, u32int* b, int nb, u32int* r);
+void	setsinit(void);
+
+extern int	(*isect32)(u32int* a, int na, u32int* b, int nb, u32int* r);
+extern int	(*union32)(u32int* a, int na, u32int* b, int nb, u32int* r);
+extern char*	isectkind;
+extern char*	unionkind;
@@ -2,11 +2,15 @@
 #include <libc.h>
 #include <bio.h>
 #include <ctype.h>
+#include "arena.h"
+#include "post.h"
+#include "docs.h"
 #include "trie.h"
 #include "util.h"
 
 enum {
 	Ntoks = 1024,
+	Nctlbuf = 8000,	// bytes of tag records per ctl write, below the iounit
 };
 
 typedef struct Prog Prog;
@@ -124,12 +128,68 @@ runfile(char* fname)
 	}
 }
 
+/*
+ * Tags for a running tagfs are sent in records
+ * "tag qid tag...", one per line, with many records
+ * in each write to its ctl file.
+ */
+
+char	ctlbuf[Nctlbuf];
+int	nctlbuf;
+int	inrec;	// a record is open in ctlbuf
+uvlong	recqid;	// for it
+
+static void
+ctlendrec(void)
+{
+	if(inrec){
+		ctlbuf[nctlbuf++] = '\n';
+		inrec = 0;
+	}
+}
+
+static void
+ctlflush(int triefd)
+{
+	ctlendrec();
+	if(nctlbuf > 0 && write(triefd, ctlbuf, nctlbuf) != nctlbuf)
+		sysfatal("trie ctl: write: %r");
+	nctlbuf = 0;
+}
+
+static void
+ctltag(int triefd, char* s, uvlong qid)
+{
+	char	hdr[32];
+	int	nh, l;
+
+	if(inrec && qid != recqid)
+		ctlendrec();
+	nh = 0;
+	if(!inrec)
+		nh = snprint(hdr, sizeof hdr, "tag %llux", qid);
+	l = strlen(s);
+	// room for the tag and the newline ending the record.
+	if(nctlbuf + nh + 1 + l + 1 > Nctlbuf){
+		ctlflush(triefd);
+		nh = snprint(hdr, sizeof hdr, "tag %llux", qid);
+	}
+	if(!inrec){
+		memmove(ctlbuf+nctlbuf, hdr, nh);
+		nctlbuf += nh;
+		inrec = 1;
+		recqid = qid;
+	}
+	ctlbuf[nctlbuf++] = ' ';
+	memmove(ctlbuf+nctlbuf, s, l);
+	nctlbuf += l;
+}
+
 void
 tag(Trie* t, int triefd, char* s, uvlong qid)
 {
 	int	l;
 	char*	q;
-	char	str[200];
 	Rune	r;
 	int	nc;
 
@@ -151,11 +211,8 @@ tag(Trie* t, int triefd, char* s, uvlong qid)
 		fprint(2, "\t%s\n", s);
 	if(triefd < 0)
 		trieput(t, s, qid);
-	else {
-		seprint(str, str+sizeof(str), "tag %llux %s", qid, s);
-		if (write(triefd, str, strlen(str)) != strlen(str))
-			sysfatal("trie ctl: write: %r");
-	}
+	else
+		ctltag(triefd, s, qid);
 }
 
 void
@@ -331,7 +388,7 @@ fail:
 void
 usage(void)
 {
-	fprint(2, "usage: %s [-d] trie file...\n", argv0);
+	fprint(2, "usage: %s [-df] trie file...\n", argv0);
 	exits("usage");
 }
 
@@ -353,6 +410,9 @@ main(int argc, char* argv[])
 	case 'd':
 		debug++;
 		break;
+	case 'f':
+		usefreqs = 1;
+		break;
 	default:
 		usage();
 	}ARGEND;
@@ -404,9 +464,14 @@ main(int argc, char* argv[])
 		close(fd);
 		if(myrename(tfname, ttfname) <0)
 			sysfatal("can't rename %s to %s: %r", ttfname, tfname);
+		if(debug && t->arena != nil && t->arena->nnodes > 0)
+			fprint(2, "%ld prefixes, %lld bytes, %lld bytes/prefix\n",
+				t->arena->nnodes, t->arena->nbytes,
+				t->arena->nbytes/t->arena->nnodes);
 //		freetrie(t);
 	} else{
-		write(triefd, "sync", 4);
+		ctlflush(triefd);
+		write(triefd, "sync wait", 9);
 		close(triefd);
 	}
 	exits(nil);
@@ -6,21 +6,490 @@
 #include <auth.h>
 #include <9p.h>
 #include <ctype.h>
+#include "arena.h"
+#include "post.h"
+#include "docs.h"
 #include "trie.h"
 #include "util.h"
+#include "sets.h"
 #include "query.h"
 
+enum {
+	Ncache = 64,	// query results cached
+	Ncachevals = 1024*1024,	// values kept in cached results
+	Nprocs = 4,	// serving reads and writes, by default
+	Stack = 64*1024,
+	Jmin = 1024*1024,	// journal bytes to fold into the trie file
+	Jfrac = 4,	// or, if more, this fraction of the file
+};
+
 typedef struct Query Query;
+typedef struct Centry Centry;
+typedef struct Chan Chan;
+typedef struct Creq Creq;
+typedef struct Prep Prep;
+typedef struct Snap Snap;
+typedef struct Swait Swait;
 
+/* Query files keep a reference to their Query in aux,
+ * and requests take another while they use it.
+ */
 struct Query{
+	Ref	ref;
+	QLock	lk;
 	char*	text;
 	Texpr*	expr;	// non-nil after query write completed
+	Snap*	snap;	// where expr was evaluated
+	Vpos	pos;	// of the last read in the result
+};
+
+/*
+ * A query channel is the state for a fid open on the
+ * queries file. Each line written is a request, and reads
+ * return the replies in order, evaluating requests as
+ * they are reached:
+ *
+ *	expr		ok n, and a line with the n values if n > 0
+ *	def name expr	ok 0, keeping expr as name
+ *	run name	as for the expr kept as name
+ *
+ * Failed requests get "error msg" instead.
+ * The requests written before a read are evaluated
+ * together when it reaches the first of them.
+ */
+struct Chan{
+	QLock	lk;
+	char*	line;	// partial line written
+	Creq*	reqs;
+	Creq**	lastp;
+	Prep*	preps;
+	char	hdr[ERRMAX+16];	// of the reply being read
+	int	nhdr;
+	int	ihdr;	// bytes of hdr already read
+	Texpr*	expr;	// values of the reply being read
+	Snap*	snap;	// for expr
+	Vpos	pos;
+	vlong	off;
+};
+
+struct Creq{
+	char*	text;
+	int	done;	// evaluated
+	char*	err;	// if it failed
+	Texpr*	expr;	// the result, nil for def
+	Snap*	snap;	// for expr
+	Creq*	next;
+};
+
+/* A prepared query, compiled again on each run
+ * so it sees tags added since.
+ */
+struct Prep{
+	char*	name;
+	char*	text;
+	Prep*	next;
+};
+
+/* A version of the trie, frozen when published, after
+ * each write of tag records (see publish).
+ * Queries are evaluated on it, holding a reference while
+ * they use its values. Versions are freed oldest first,
+ * once unused, by reap.
+ */
+struct Snap{
+	Ref	ref;
+	Trie*	t;
+	int	gen;
+	vlong	mark;	// jseq when published
+	Adead*	dead;	// what t used and the next one does not
+	Trie*	old;	// trie replaced by a reload, freed with this
+	Snap*	next;	// the one published after
+};
+
+/* A "sync wait" request, answered by compactproc
+ * once the journal is folded into tfname up to want.
+ */
+struct Swait{
+	Req*	r;
+	vlong	want;	// jseq when asked
+	int	done;
+	Swait*	next;
 };
 
+/* A cached query result, kept in LRU order.
+ */
+struct Centry{
+	char*	key;	// from exprkey
+	int	gen;	// of the version it comes from
+	Vals*	vals;
+	Centry*	prev;
+	Centry*	next;
+};
+
+/*
+ * Reads and writes are served by a pool of procs.
+ * Tag writes change the trie and publish it as the
+ * version for new queries, which use it and do not wait
+ * for them. The trie shares with older versions what it
+ * did not change (see trienext).
+ * trielk is for the trie and the journal, and the state
+ * of compaction. snaplk is for the versions and their refs.
+ * cachelk is for the cache and its stats, and the lock in
+ * each Query and Chan for it.
+ *
+ * Tag records are appended to a journal before they are
+ * applied, and replayed at start. Sync makes the journal
+ * stable. Compaction writes a version to tfname and empties
+ * the journal of its records, in the background, once the
+ * journal has Jmin bytes and 1/Jfrac of the size of tfname,
+ * so rewriting the file costs a few times the bytes journaled.
+ * It writes without holding trielk, and new records are
+ * journaled, applied, and held for the new journal.
+ * Reloads replace the trie with the one in tfname, as
+ * rebuilt by other tools. compactproc makes them too, and
+ * compacts after them if the journal has records.
+ */
+
 Trie*	trie;
+QLock	trielk;
+char*	jfname;
+char*	tjfname;
+int	jfd = -1;
+vlong	jsize;	// bytes in the journal
+vlong	jseq;	// bytes ever journaled
+vlong	jdone;	// and those in tfname
+vlong	tsize;	// bytes in tfname
+Channel*	compactc;	// to ask for a compaction
+int	compacting;	// a version is being written
+char*	held;	// records journaled meanwhile
+long	nheld;
+long	aheld;
+int	ncompact;	// compactions done
+int	reloadreq;	// a reload is wanted
+int	lazy;	// load trie nodes as they are used
+int	nreload;	// reloads done
+char	reloaderr[ERRMAX];	// error for the last one
+Swait*	swaits;	// sync waits not answered
+vlong	syncstart;	// in ns, of the last compaction
+vlong	synctime;	// and how long it took
+vlong	syncbytes;	// and its size
+char	syncerr[ERRMAX];	// and its error, if any
+Lock	snaplk;
+Snap*	snap;	// the current version
+Snap*	snaps;	// the oldest kept
 File*	ctlf;
+File*	chanf;
 char*	tfname;
 char*	ttfname;
+Channel*	reqc;	// of Req* for the procs
+
+Lock	querylk;	// for aux in query files
+QLock	cachelk;
+Centry	cache = {.prev = &cache, .next = &cache};	// cache.next is the last used
+int	cachegen;	// of the version tag writes go to
+int	ncache;
+long	ncachevals;
+vlong	nhits;
+vlong	nmisses;
+
+static void
+uncache(Centry* c)
+{
+	c->prev->next = c->next;
+	c->next->prev = c->prev;
+	ncache--;
+	ncachevals -= c->vals->nv;
+	free(c->key);
+	freevals(c->vals);
+	free(c);
+}
+
+static void
+cachefront(Centry* c)
+{
+	c->next = cache.next;
+	c->prev = &cache;
+	cache.next->prev = c;
+	cache.next = c;
+}
+
+/* Results are dropped when a tag they use is written,
+ * so they hold for later versions too, but not for
+ * older ones. Results for a version are not kept
+ * once tags are written for the next one.
+ */
+static Centry*
+cacheget(char* key, int gen)
+{
+	Centry*	c;
+
+	for(c = cache.next; c != &cache; c = c->next)
+		if(c->gen <= gen && strcmp(c->key, key) == 0){
+			c->prev->next = c->next;
+			c->next->prev = c->prev;
+			cachefront(c);
+			return c;
+		}
+	return nil;
+}
+
+static void
+cacheput(char* key, Texpr* e, int gen)
+{
+	Centry*	c;
+
+	if(nexprval(e) > Ncachevals/4)
+		return;
+	qlock(&cachelk);
+	if(gen != cachegen){
+		qunlock(&cachelk);
+		return;
+	}
+	c = emalloc9p(sizeof *c);
+	c->key = estrdup9p(key);
+	c->gen = gen;
+	c->vals = dupvals(e->rval);
+	cachefront(c);
+	ncache++;
+	ncachevals += c->vals->nv;
+	while(ncache > Ncache || ncachevals > Ncachevals)
+		uncache(cache.prev);
+	qunlock(&cachelk);
+}
+
+/* Does the key use tag?
+ */
+static int
+keyhas(char* key, char* tag)
+{
+	char*	p;
+	int	n;
+
+	n = strlen(tag);
+	for(p = key; (p = strstr(p, tag)) != nil; p++)
+		if((p == key || p[-1] == ' ' || p[-1] == '(') &&
+		   (p[n] == 0 || p[n] == ' ' || p[n] == ')'))
+			return 1;
+	return 0;
+}
+
+/* Drop results using a tag that changed.
+ */
+static void
+cacheinval(char* tag)
+{
+	Centry*	c;
+	Centry*	nc;
+	char*	k;
+
+	qlock(&cachelk);
+	if(ncache == 0){
+		qunlock(&cachelk);
+		return;
+	}
+	k = tagkey(tag);
+	for(c = cache.next; c != &cache; c = nc){
+		nc = c->next;
+		if(keyhas(c->key, k))
+			uncache(c);
+	}
+	qunlock(&cachelk);
+	free(k);
+}
+
+static Snap*
+getsnap(void)
+{
+	Snap*	s;
+
+	lock(&snaplk);
+	s = snap;
+	incref(&s->ref);
+	unlock(&snaplk);
+	return s;
+}
+
+static Snap*
+dupsnap(Snap* s)
+{
+	lock(&snaplk);
+	incref(&s->ref);
+	unlock(&snaplk);
+	return s;
+}
+
+/* Versions are freed by reap, when
+ * no longer used.
+ */
+static void
+putsnap(Snap* s)
+{
+	if(s == nil)
+		return;
+	lock(&snaplk);
+	decref(&s->ref);
+	unlock(&snaplk);
+}
+
+/* Free the oldest versions no longer used.
+ * Each one may free what the next one retired, as
+ * the older ones are gone. Called holding trielk.
+ */
+static void
+reap(void)
+{
+	Snap*	s;
+
+	for(;;){
+		lock(&snaplk);
+		s = snaps;
+		if(s == snap || s->ref.ref > 0){
+			unlock(&snaplk);
+			return;
+		}
+		snaps = s->next;
+		unlock(&snaplk);
+		freeversion(s->t, s->dead);
+		freetrie(s->old);
+		free(s);
+	}
+}
+
+/* Make the trie the version for new queries, and go on
+ * with the next one. prev is the trie it replaced, after
+ * a reload, or nil.
+ * Called holding trielk, or before serving requests.
+ */
+static void
+publish(Trie* prev)
+{
+	Snap*	s;
+	Snap*	old;
+	Adead*	d;
+
+	if(prev == nil)
+		prev = trie;
+	d = aretired(prev->arena);
+	s = emalloc9p(sizeof *s);
+	memset(s, 0, sizeof *s);
+	s->ref.ref = 1;
+	s->t = trie;
+	s->mark = jseq;
+	trie = trienext(trie);
+	lock(&snaplk);
+	old = snap;
+	if(old != nil){
+		s->gen = old->gen + 1;
+		old->dead = d;
+		if(prev != s->t)
+			old->old = prev;
+		old->next = s;
+	} else
+		snaps = s;
+	snap = s;
+	unlock(&snaplk);
+	if(old == nil)
+		afreedead(prev->arena, d);
+	putsnap(old);
+	reap();
+}
+
+/* Parse the query in text.
+ * Returns nil and sets the error string on errors.
+ */
+static Texpr*
+compile(char* text)
+{
+	char**	toks;
+	int	ntoks;
+	int	atoks;
+	char*	s;
+	int	pos;
+	Texpr*	e;
+
+	atoks = 512;
+	toks = emalloc9p(atoks*sizeof(char*));
+	for(;;){
+		s = estrdup9p(text);
+		ntoks = tokenize(s, toks, atoks);
+		if(ntoks < atoks)
+			break;
+		atoks += 512;
+		toks = erealloc9p(toks, atoks*sizeof(char*));
+		free(s);
+	}
+	pos = 0;
+	if(chatty9p)
+		fprint(2, "compiling %s (%d toks)\n", text, ntoks);
+	e = parseexpr(ntoks, toks, &pos);
+	free(s);
+	free(toks);
+	return e;
+}
+
+/* Set the result for e from the cache, if there.
+ * Otherwise, *keyp is the key to cache it once
+ * evaluated, or nil if it is not to be cached.
+ */
+static int
+cachequery(Texpr* e, Snap* s, char** keyp)
+{
+	char*	key;
+	Centry*	c;
+
+	/* ranks depend on all files, not just
+	 * on those with the tags: not cached.
+	 */
+	*keyp = nil;
+	key = nil;
+	if(e->rank == 0)
+		key = exprkey(e);
+	qlock(&cachelk);
+	c = nil;
+	if(key != nil)
+		c = cacheget(key, s->gen);
+	if(c == nil){
+		nmisses++;
+		qunlock(&cachelk);
+		if(chatty9p && key != nil)
+			fprint(2, "evaluating %s\n", key);
+		*keyp = key;
+		return 0;
+	}
+	nhits++;
+	setexprval(e, c->vals, s->t->docs);
+	qunlock(&cachelk);
+	free(key);
+	return 1;
+}
+
+/* Evaluate e on s, using the cache.
+ */
+static void
+evalquery(Texpr* e, Snap* s)
+{
+	char*	key;
+
+	if(!cachequery(e, s, &key)){
+		evalexpr(s->t, e);
+		if(key != nil)
+			cacheput(key, e, s->gen);
+		free(key);
+	}
+	if(chatty9p)
+		fprint(2, "result has %d values\n", nexprval(e));
+}
+
+static void
+putquery(Query* q)
+{
+	if(decref(&q->ref) > 0)
+		return;
+	free(q->text);
+	freeexpr(q->expr);
+	putsnap(q->snap);
+	free(q);
+}
 
 static void
 fscreate(Req* r)
@@ -41,17 +510,20 @@ fscreate(Req* r)
 		respond(r, "queries cannot be directories");
 		return;
 	}
-	if(f = createfile(file, name, uid, mode, nil)){
-		q = emalloc9p(sizeof *q);
-		q->text = estrdup9p("");
-		q->expr = nil;
-		f->aux = q;
+	// the file has its query as soon as other procs may see it.
+	q = emalloc9p(sizeof *q);
+	q->ref.ref = 1;
+	q->text = estrdup9p("");
+	q->expr = nil;
+	if(f = createfile(file, name, uid, mode, q)){
 		closefile(r->fid->file);
 		r->fid->file = f;
 		r->ofcall.qid = f->dir.qid;
 		respond(r, nil);
-	} else
+	} else {
+		putquery(q);
 		respond(r, "problem creating file");
+	}
 }
 
 void
@@ -76,68 +548,831 @@ tag(Trie* t, char* s, uvlong qid)
 		q += nc;
 	}
 	trieput(t, s, qid);
+	cacheinval(s);
 }
 
-static void
-ctlwrite(Req* r)
+/* Apply the tag records in s, one per line, to the trie.
+ * Called holding trielk, or before serving requests.
+ * Returns the number of records.
+ */
+static int
+tagrecs(char* s)
+{
+	char**	toks;
+	char*	nl;
+	int	i, ntoks, atoks, n;
+	uvlong	qid;
+
+	atoks = strlen(s)/2+2;
+	toks = emalloc9p(atoks*sizeof(char*));
+	for(n = 0; s != nil; s = nl){
+		nl = strchr(s, '\n');
+		if(nl != nil)
+			*nl++ = 0;
+		ntoks = tokenize(s, toks, atoks);
+		if(ntoks < 3 || strcmp(toks[0], "tag") != 0)
+			continue;
+		qid = strtoull(toks[1], nil, 16);
+		for(i = 2; i < ntoks; i++)
+			tag(trie, toks[i], qid);
+		n++;
+	}
+	free(toks);
+	return n;
+}
+
+/* The qid path of f, which renames keep, or -1.
+ */
+static vlong
+fileid(char* f)
+{
+	Dir*	d;
+	vlong	id;
+
+	d = dirstat(f);
+	if(d == nil)
+		return -1;
+	id = d->qid.path;
+	free(d);
+	return id;
+}
+
+/* The size of f, or 0.
+ */
+static vlong
+filelen(char* f)
+{
+	Dir*	d;
+	vlong	n;
+
+	d = dirstat(f);
+	if(d == nil)
+		return 0;
+	n = d->length;
+	free(d);
+	return n;
+}
+
+/* End a compaction stopped after renaming the journal,
+ * as seen by its first line naming ttfname, or while
+ * renaming it (myrename removes jfname first on Plan 9).
+ * Called at start and before each compaction, which may
+ * not remove ttfname until this is done.
+ */
+static int
+recover(void)
+{
+	Biobuf*	b;
+	char*	ln;
+	vlong	base;
+
+	if(access(jfname, AEXIST) < 0 && access(tjfname, AEXIST) == 0){
+		fprint(2, "%s: recovering %s\n", argv0, tjfname);
+		if(myrename(jfname, tjfname) < 0){
+			werrstr("%s: rename failure", tjfname);
+			return -1;
+		}
+	}
+	b = Bopen(jfname, OREAD);
+	if(b == nil)
+		return 0;
+	ln = Brdstr(b, '\n', 1);
+	Bterm(b);
+	if(ln != nil && strncmp(ln, "base ", 5) == 0){
+		base = strtoull(ln+5, nil, 16);
+		if(base != fileid(tfname) && base == fileid(ttfname)){
+			fprint(2, "%s: recovering %s\n", argv0, ttfname);
+			if(myrename(tfname, ttfname) < 0){
+				free(ln);
+				werrstr("%s: rename failure", ttfname);
+				return -1;
+			}
+		}
+	}
+	free(ln);
+	return 0;
+}
+
+/* Apply the tag records in the journal.
+ * Returns their size in bytes.
+ */
+static vlong
+replay(void)
+{
+	Biobuf*	b;
+	char*	ln;
+	vlong	n;
+
+	b = Bopen(jfname, OREAD);
+	if(b == nil)
+		return 0;
+	for(n = 0; (ln = Brdstr(b, '\n', 1)) != nil; free(ln))
+		if(strncmp(ln, "base ", 5) != 0){
+			n += strlen(ln) + 1;
+			tagrecs(ln);
+		}
+	Bterm(b);
+	return n;
+}
+
+/* Replace the journal with the records held while
+ * the trie was written, after a line naming the trie
+ * file they go with. Called holding trielk.
+ * Once the new journal has its name, this can't fail,
+ * as its fd is kept from before.
+ */
+static int
+rejournal(vlong base)
 {
-	char	buf[1024];
-	char*	toks[512];
 	int	fd;
+
+	fd = create(tjfname, OWRITE, 0664);
+	if(fd < 0){
+		werrstr("%s: %r", tjfname);
+		return -1;
+	}
+	if(fprint(fd, "base %llux\n", base) < 0 || write(fd, held, nheld) != nheld ||
+	   syncfile(fd) < 0){
+		close(fd);
+		remove(tjfname);
+		werrstr("%s: %r", tjfname);
+		return -1;
+	}
+	// if jfname is gone, tjfname is the journal, left for recover.
+	if(myrename(jfname, tjfname) < 0 && access(jfname, AEXIST) == 0){
+		close(fd);
+		remove(tjfname);
+		werrstr("%s: rename failure", tjfname);
+		return -1;
+	}
+	if(jfd >= 0)
+		close(jfd);
+	jfd = fd;
+	jsize = nheld;
+	return 0;
+}
+
+/* Write the current version to tfname, and keep in
+ * the journal just the records that came meanwhile.
+ * If it fails before renaming the journal, it is kept
+ * whole. If it fails after, ttfname is left for recover.
+ * The new journal names the new file before it is
+ * renamed to tfname, so recover can end the rename if
+ * we stop in between, and records are never replayed
+ * on a trie that has them.
+ */
+static int
+compact(void)
+{
+	int	fd, ok;
 	Biobuf	bout;
-	int	ntoks;
-	long	count;
-	uvlong	qid;
-	int	i;
+	Snap*	s;
+	vlong	nb;
+
+	qlock(&trielk);
+	s = getsnap();
+	compacting = 1;
+	nheld = 0;
+	syncstart = nsec();
+	qunlock(&trielk);
+	ok = 0;
+	nb = 0;
+	if(recover() < 0)
+		goto done;
+	// a new file, not one named by a journal.
+	remove(ttfname);
+	fd = create(ttfname, OWRITE, 0664);
+	if(fd < 0){
+		werrstr("%s: %r", ttfname);
+		goto done;
+	}
+	Binit(&bout, fd, OWRITE);
+	if(wrtrie(&bout, s->t) < 0 || Bflush(&bout) < 0 || syncfile(fd) < 0){
+		Bterm(&bout);
+		close(fd);
+		remove(ttfname);
+		werrstr("%s: write failure", ttfname);
+		goto done;
+	}
+	nb = Boffset(&bout);
+	Bterm(&bout);
+	close(fd);
+	ok = 1;
+done:
+	qlock(&trielk);
+	if(ok && rejournal(fileid(ttfname)) < 0){
+		remove(ttfname);
+		ok = 0;
+	} else if(ok && myrename(tfname, ttfname) < 0){
+		// left for recover, as the journal names it.
+		werrstr("rename failure");
+		ok = 0;
+	}
+	if(ok){
+		jdone = s->mark;
+		tsize = nb;
+	}
+	syncerr[0] = 0;
+	if(!ok)
+		rerrstr(syncerr, sizeof syncerr);
+	nheld = 0;
+	compacting = 0;
+	synctime = nsec() - syncstart;
+	syncbytes = nb;
+	ncompact++;
+	putsnap(s);
+	reap();
+	qunlock(&trielk);
+	if(!ok)
+		return -1;
+	if(chatty9p)
+		fprint(2, "compacted %s\n", tfname);
+	return 0;
+}
+
+/* Read the trie in tfname, whole or, with -l,
+ * loading its nodes as they are used.
+ */
+static Trie*
+loadtrie(void)
+{
+	Biobuf*	b;
+	Trie*	t;
+
+	if(lazy)
+		return opentrie(tfname);
+	b = Bopen(tfname, OREAD);
+	if(b == nil)
+		return nil;
+	t = rdtrie(b);
+	Bterm(b);
+	return t;
+}
+
+/* Load the trie in tfname, and make it the one used.
+ * Queries running keep the version they have.
+ * The journal is replayed on the new trie, and left
+ * for compaction to fold in.
+ */
+static int
+reload(void)
+{
+	Trie*	t;
+	Trie*	prev;
+
+	t = loadtrie();
+	if(t == nil){
+		werrstr("%s: %r", tfname);
+		goto fail;
+	}
+	qlock(&trielk);
+	prev = trie;
+	trie = t;
+	// results may be from tags not in the new trie.
+	qlock(&cachelk);
+	while(ncache > 0)
+		uncache(cache.prev);
+	cachegen = snap->gen + 1;
+	qunlock(&cachelk);
+	replay();
+	publish(prev);
+	tsize = filelen(tfname);
+	nreload++;
+	reloaderr[0] = 0;
+	qunlock(&trielk);
+	if(chatty9p)
+		fprint(2, "reloaded %s\n", tfname);
+	return 0;
+fail:
+	qlock(&trielk);
+	nreload++;
+	rerrstr(reloaderr, sizeof reloaderr);
+	qunlock(&trielk);
+	return -1;
+}
+
+/* Answer r once the records journaled so far are
+ * in tfname. compactproc does it, and the proc
+ * serving r is free meanwhile.
+ */
+static void
+syncwait(Req* r)
+{
+	Swait*	w;
+
+	qlock(&trielk);
+	if(jdone >= jseq){
+		qunlock(&trielk);
+		respond(r, nil);
+		return;
+	}
+	w = emalloc9p(sizeof *w);
+	w->r = r;
+	w->want = jseq;
+	w->done = 0;
+	w->next = swaits;
+	swaits = w;
+	nbsendul(compactc, 1);
+	qunlock(&trielk);
+}
+
+/* Answer the sync waits done after a compaction,
+ * and the others with err if it failed.
+ */
+static void
+syncwake(char* err)
+{
+	Swait*	w;
+	Swait*	ready;
+	Swait**	l;
+
+	ready = nil;
+	qlock(&trielk);
+	for(l = &swaits; (w = *l) != nil; ){
+		w->done = jdone >= w->want;
+		if(w->done || err != nil){
+			*l = w->next;
+			w->next = ready;
+			ready = w;
+		} else
+			l = &w->next;
+	}
+	// records came while compacting.
+	if(swaits != nil)
+		nbsendul(compactc, 1);
+	qunlock(&trielk);
+	while((w = ready) != nil){
+		ready = w->next;
+		respond(w->r, w->done ? nil : err);
+		free(w);
+	}
+}
+
+/* Append n bytes of tag records to the journal.
+ * Called holding trielk.
+ */
+static int
+jappend(char* s, long n)
+{
+	if(jfd < 0){
+		werrstr("no journal");
+		return -1;
+	}
+	seek(jfd, 0, 2);
+	if(write(jfd, s, n) != n){
+		werrstr("%s: %r", jfname);
+		return -1;
+	}
+	jsize += n;
+	jseq += n;
+	return 0;
+}
+
+/* Journal the n bytes of tag records in s, apply them,
+ * and publish the trie with them. While compacting, they
+ * are held for the new journal too, and otherwise a
+ * compaction is asked for if the journal is large.
+ * Nothing is applied if the journal can't keep them.
+ */
+static int
+logrecs(char* s, long n)
+{
+	qlock(&trielk);
+	if(jappend(s, n) < 0){
+		qunlock(&trielk);
+		return -1;
+	}
+	if(compacting){
+		if(nheld+n+1 > aheld){
+			aheld = 2*(nheld+n+1);
+			held = erealloc9p(held, aheld);
+		}
+		memmove(held+nheld, s, n);
+		nheld += n;
+	} else if(jsize >= Jmin && jsize >= tsize/Jfrac)
+		nbsendul(compactc, 1);
+	qlock(&cachelk);
+	cachegen = snap->gen + 1;
+	qunlock(&cachelk);
+	s[n] = 0;
+	tagrecs(s);
+	publish(nil);
+	qunlock(&trielk);
+	return 0;
+}
+
+static void
+compactproc(void*)
+{
+	char	err[ERRMAX];
+	char*	e;
+	int	rl, c;
+
+	threadsetname("compactproc");
+	for(;;){
+		recvul(compactc);
+		qlock(&trielk);
+		rl = reloadreq;
+		reloadreq = 0;
+		qunlock(&trielk);
+		if(rl && reload() < 0)
+			fprint(2, "%s: reload: %r\n", argv0);
+		// with nothing journaled, the trie file is up to date,
+		// unless its rename was left for recover.
+		qlock(&trielk);
+		c = jsize > 0 || swaits != nil;
+		qunlock(&trielk);
+		e = nil;
+		if(c && compact() < 0){
+			rerrstr(err, sizeof err);
+			fprint(2, "%s: compact: %s\n", argv0, err);
+			e = err;
+		}
+		syncwake(e);
+	}
+}
+
+/* A ctl write may carry many requests, one per line.
+ * Consecutive tag records are journaled and applied
+ * holding trielk once. Records before a bad one are kept.
+ * Sync makes the journal stable. "sync wait" is answered
+ * once the records written, in this write too, are in the
+ * trie file (see syncwait). Reload does not wait.
+ */
+static void
+ctlwrite(Req* r)
+{
+	char	err[ERRMAX];
+	char*	buf;
+	char*	recs;
+	char**	toks;
+	char*	ln;
+	char*	nl;
+	char*	e;
+	int	ntoks, nreq, wait;
+	long	count, nrecs, l;
 
 	count = r->ifcall.count;
-	if(count > sizeof(buf)-1)
-		count=sizeof(buf)-1;
 	r->ofcall.count = count;
+	buf = emalloc9p(count+1);
 	memmove(buf, r->ifcall.data, count);
 	buf[count] = 0;
-	ntoks = tokenize(buf, toks, nelem(toks));
-	if(ntoks < 1){
-		respond(r, "null ctl");
+	recs = emalloc9p(count+2);
+	nrecs = 0;
+	toks = emalloc9p((count/2+2)*sizeof(char*));
+	e = nil;
+	nreq = 0;
+	wait = 0;
+	for(ln = buf; ln != nil && e == nil; ln = nl){
+		nl = strchr(ln, '\n');
+		if(nl != nil)
+			*nl++ = 0;
+		l = strlen(ln);
+		ntoks = tokenize(ln, toks, count/2+2);
+		if(ntoks < 1)
+			continue;
+		nreq++;
+		if(strcmp(toks[0], "tag") == 0){
+			if(ntoks < 3){
+				e = "ctl usage: tag qid tag...";
+				break;
+			}
+			// tokenize split ln; keep the record as it came.
+			memmove(recs+nrecs, r->ifcall.data+(ln-buf), l);
+			nrecs += l;
+			recs[nrecs++] = '\n';
+			continue;
+		}
+		if(nrecs > 0 && logrecs(recs, nrecs) < 0){
+			rerrstr(err, sizeof err);
+			e = err;
+			break;
+		}
+		nrecs = 0;
+		if(strcmp(toks[0], "reload") == 0){
+			qlock(&trielk);
+			reloadreq = 1;
+			qunlock(&trielk);
+			nbsendul(compactc, 1);
+		} else if(strcmp(toks[0], "sync") != 0)
+			e = "bad ctl request";
+		else if(ntoks > 1 && strcmp(toks[1], "wait") == 0)
+			wait = 1;
+		else if(ntoks > 1)
+			e = "ctl usage: sync [wait]";
+		else {
+			qlock(&trielk);
+			if(jfd >= 0 && syncfile(jfd) < 0){
+				snprint(err, sizeof err, "%s: %r", jfname);
+				e = err;
+			}
+			qunlock(&trielk);
+		}
+	}
+	if(nrecs > 0 && logrecs(recs, nrecs) < 0){
+		rerrstr(err, sizeof err);
+		e = err;
+	}
+	if(nreq == 0)
+		e = "null ctl";
+	free(toks);
+	free(recs);
+	free(buf);
+	if(e == nil && wait)
+		syncwait(r);
+	else
+		respond(r, e);
+}
+
+/* Each fid open on the queries file gets a channel.
+ */
+static void
+fsopen(Req* r)
+{
+	Chan*	c;
+
+	if(r->fid->file == chanf){
+		c = emalloc9p(sizeof *c);
+		memset(c, 0, sizeof *c);
+		c->line = estrdup9p("");
+		c->lastp = &c->reqs;
+		r->fid->aux = c;
+	}
+	respond(r, nil);
+}
+
+static void
+freechan(Chan* c)
+{
+	Creq*	q;
+	Prep*	p;
+
+	if(c == nil)
 		return;
+	while((q = c->reqs) != nil){
+		c->reqs = q->next;
+		free(q->text);
+		free(q->err);
+		freeexpr(q->expr);
+		putsnap(q->snap);
+		free(q);
+	}
+	while((p = c->preps) != nil){
+		c->preps = p->next;
+		free(p->name);
+		free(p->text);
+		free(p);
+	}
+	freeexpr(c->expr);
+	putsnap(c->snap);
+	free(c->line);
+	free(c);
+}
+
+/* Queue the lines written, keeping a partial one
+ * for the next write.
+ */
+static void
+chanwrite(Req* r)
+{
+	Chan*	c;
+	Creq*	q;
+	char*	s;
+	char*	nl;
+	long	count;
+	int	l;
+
+	c = r->fid->aux;
+	qlock(&c->lk);
+	count = r->ifcall.count;
+	l = strlen(c->line);
+	s = emalloc9p(l + count + 1);
+	memmove(s, c->line, l);
+	memmove(s+l, r->ifcall.data, count);
+	s[l+count] = 0;
+	free(c->line);
+	c->line = s;
+	while((nl = strchr(s, '\n')) != nil){
+		*nl = 0;
+		if(strspn(s, " \t\r") < nl - s){
+			q = emalloc9p(sizeof *q);
+			memset(q, 0, sizeof *q);
+			q->text = estrdup9p(s);
+			*c->lastp = q;
+			c->lastp = &q->next;
+		}
+		s = nl+1;
 	}
-	if(strcmp(toks[0], "tag") == 0){
+	s = estrdup9p(s);
+	free(c->line);
+	c->line = s;
+	qunlock(&c->lk);
+	r->ofcall.count = count;
+	respond(r, nil);
+}
+
+static Prep*
+lookprep(Chan* c, char* name)
+{
+	Prep*	p;
+
+	for(p = c->preps; p != nil; p = p->next)
+		if(strcmp(p->name, name) == 0)
+			return p;
+	return nil;
+}
+
+/* Compile the request q, or run it if a def.
+ */
+static void
+chanprep(Chan* c, Creq* q)
+{
+	char*	toks[3];
+	char*	s;
+	char*	text;
+	int	ntoks;
+	Prep*	p;
+	Texpr*	e;
+
+	text = q->text;
+	s = estrdup9p(text);
+	ntoks = tokenize(s, toks, nelem(toks));
+	if(ntoks > 0 && strcmp(toks[0], "def") == 0){
 		if(ntoks < 3){
-			respond(r, "ctl usage: tag qid tag...");
-			return;
+			werrstr("usage: def name expr");
+			goto fail;
 		}
-		qid = strtoull(toks[1], nil, 16);
-		for(i = 2; i < ntoks; i++)
-			tag(trie, toks[i], qid);
-	} else if(strcmp(toks[0], "sync") == 0){
-		fd = create(ttfname, OWRITE, 0664);
-		if(fd < 0){
-			respond(r, "bad fid");
-			return;
+		// the rest of the line, past the name.
+		text += strspn(text, " \t");
+		text += strlen("def");
+		text += strspn(text, " \t");
+		text += strlen(toks[1]);
+		e = compile(text);
+		if(e == nil)
+			goto fail;
+		freeexpr(e);
+		p = lookprep(c, toks[1]);
+		if(p == nil){
+			p = emalloc9p(sizeof *p);
+			p->name = estrdup9p(toks[1]);
+			p->next = c->preps;
+			c->preps = p;
+		} else
+			free(p->text);
+		p->text = estrdup9p(text);
+		free(s);
+		return;
+	}
+	if(ntoks > 0 && strcmp(toks[0], "run") == 0){
+		if(ntoks != 2 || (p = lookprep(c, toks[1])) == nil){
+			werrstr("no such query");
+			goto fail;
 		}
-		Binit(&bout, fd, OWRITE);
-		if(wrtrie(&bout, trie) < 0){
-			close(fd);
-			remove(ttfname);
-			respond(r, "wrtrie failure");
-			return;
+		text = p->text;
+	}
+	q->expr = compile(text);
+	if(q->expr == nil)
+		goto fail;
+	free(s);
+	return;
+fail:
+	q->err = smprint("%r");
+	free(s);
+}
+
+/* Evaluate the requests not yet evaluated, at once.
+ */
+static void
+chanbatch(Chan* c)
+{
+	Creq*	q;
+	Texpr**	es;
+	char**	keys;
+	Snap*	s;
+	int	i, n;
+
+	s = getsnap();
+	n = 0;
+	for(q = c->reqs; q != nil; q = q->next)
+		n++;
+	es = emalloc9p(n*sizeof(Texpr*));
+	keys = emalloc9p(n*sizeof(char*));
+	n = 0;
+	for(q = c->reqs; q != nil; q = q->next){
+		if(q->done)
+			continue;
+		q->done = 1;
+		chanprep(c, q);
+		if(q->expr == nil)
+			continue;
+		q->snap = dupsnap(s);
+		if(!cachequery(q->expr, s, &keys[n]))
+			es[n++] = q->expr;
+	}
+	evalbatch(s->t, es, n);
+	for(i = 0; i < n; i++){
+		if(keys[i] != nil)
+			cacheput(keys[i], es[i], s->gen);
+		free(keys[i]);
+	}
+	putsnap(s);
+	free(keys);
+	free(es);
+}
+
+/* Replies are read as a stream, ignoring offsets.
+ * Reads return what is ready, and 0 when there
+ * are no more requests.
+ */
+static void
+chanread(Req* r)
+{
+	Chan*	c;
+	Creq*	q;
+	char*	buf;
+	long	n, m, count;
+
+	c = r->fid->aux;
+	qlock(&c->lk);
+	buf = r->ofcall.data;
+	count = r->ifcall.count;
+	for(n = 0; n < count; ){
+		if(c->ihdr < c->nhdr){
+			m = c->nhdr - c->ihdr;
+			if(m > count - n)
+				m = count - n;
+			memmove(buf+n, c->hdr+c->ihdr, m);
+			c->ihdr += m;
+			n += m;
+			continue;
 		}
-		Bterm(&bout);
-		close(fd);
-		if(myrename(tfname, ttfname) < 0){
-			respond(r, "rename failure");
-			remove(ttfname);
-			return;
+		if(c->expr != nil){
+			m = readexprval(c->expr, &c->pos, c->off, buf+n, count-n);
+			if(m > 0){
+				c->off += m;
+				n += m;
+				continue;
+			}
+			freeexpr(c->expr);
+			putsnap(c->snap);
+			c->expr = nil;
+			c->snap = nil;
 		}
-	} else {
-		respond(r, "bad ctl request");
-		return;
+		if((q = c->reqs) == nil)
+			break;
+		if(!q->done)
+			chanbatch(c);
+		c->reqs = q->next;
+		if(c->reqs == nil)
+			c->lastp = &c->reqs;
+		c->ihdr = 0;
+		if(q->err != nil)
+			c->nhdr = snprint(c->hdr, sizeof c->hdr, "error %s\n", q->err);
+		else if(q->expr == nil)
+			c->nhdr = snprint(c->hdr, sizeof c->hdr, "ok 0\n");
+		else {
+			c->nhdr = snprint(c->hdr, sizeof c->hdr, "ok %d\n", nexprval(q->expr));
+			c->expr = q->expr;
+			c->snap = q->snap;
+			c->pos.i = 0;
+			c->pos.off = 0;
+			c->off = 0;
+		}
+		free(q->text);
+		free(q->err);
+		free(q);
 	}
+	qunlock(&c->lk);
+	r->ofcall.count = n;
 	respond(r, nil);
 }
 
+/* The query for f, locked and referenced, or nil
+ * if the file was removed.
+ */
+static Query*
+getquery(File* f)
+{
+	Query*	q;
+
+	lock(&querylk);
+	q = f->aux;
+	if(q != nil)
+		incref(&q->ref);
+	unlock(&querylk);
+	if(q == nil)
+		return nil;
+	qlock(&q->lk);
+	if(f->aux != q){
+		qunlock(&q->lk);
+		putquery(q);
+		return nil;
+	}
+	return q;
+}
+
 static void
-fswrite(Req* r)
+writereq(Req* r)
 {
 	Query*	q;
 	File*	f;
@@ -154,15 +1389,25 @@ fswrite(Req* r)
 		ctlwrite(r);
 		return;
 	}
+	if(f == chanf){
+		chanwrite(r);
+		return;
+	}
 	count = r->ifcall.count;
 	r->ofcall.count = count;
-	q = f->aux;
+	q = getquery(f);
+	if(q == nil){
+		respond(r, "query removed");
+		return;
+	}
 	if(q->expr != nil){
 		// a previous query was made. start another.
 		freeexpr(q->expr);
+		putsnap(q->snap);
 		free(q->text);
 		q->expr = nil;
-		q->text = nil;
+		q->snap = nil;
+		q->text = estrdup9p("");
 	}
 	/* append text to query text, ignore offset.
 	 */
@@ -173,6 +1418,8 @@ fswrite(Req* r)
 	ntext[l+count]=0;
 	free(q->text);
 	q->text = ntext;
+	qunlock(&q->lk);
+	putquery(q);
 	respond(r, nil);
 }
 
@@ -182,11 +1429,44 @@ ctlread(Req* r)
 	char	buf[4096];
 	char*	s;
 	int	i;
+	Snap*	sn;
+	Dir*	d;
 
+	sn = getsnap();
+	qlock(&trielk);
 	s = seprint(buf, buf+sizeof(buf), "trie %s\n", tfname);
 	s = seprint(s, buf+sizeof(buf), "prefixes %ld\n", ntries);
 	s = seprint(s, buf+sizeof(buf), "tags %ld\n", nvaltries);
 	s = seprint(s, buf+sizeof(buf), "max entry %ld\n", maxvals);
+	s = seprint(s, buf+sizeof(buf), "files %d\n", trie->docs->n);
+	if(trie->img != nil)
+		s = seprint(s, buf+sizeof(buf), "loading from image of %lld nodes\n",
+			trie->img->nnodes);
+	s = seprint(s, buf+sizeof(buf), "version %d files %d\n",
+		sn->gen, sn->t->docs->n);
+	putsnap(sn);
+	s = seprint(s, buf+sizeof(buf), "journal %s %lld bytes compacts at %lld\n",
+		jfname, jsize, tsize/Jfrac > Jmin ? tsize/Jfrac : Jmin);
+	if(compacting){
+		d = dirstat(ttfname);
+		s = seprint(s, buf+sizeof(buf), "compaction running %lld ms %lld bytes written %ld held\n",
+			(nsec()-syncstart)/1000000, d != nil ? d->length : 0LL, nheld);
+		free(d);
+	}
+	if(nreload > 0)
+		s = seprint(s, buf+sizeof(buf), "reloads %d%s%s\n",
+			nreload, reloaderr[0] != 0 ? " error: " : "", reloaderr);
+	if(ncompact > 0)
+		s = seprint(s, buf+sizeof(buf), "last compaction %lld ms %lld bytes%s%s\n",
+			synctime/1000000, syncbytes, syncerr[0] != 0 ? " error: " : "", syncerr);
+	qlock(&cachelk);
+	s = seprint(s, buf+sizeof(buf), "cache %d results %ld values %lld hits %lld misses\n",
+		ncache, ncachevals, nhits, nmisses);
+	qunlock(&cachelk);
+	if(trie->arena != nil && trie->arena->nnodes > 0)
+		s = seprint(s, buf+sizeof(buf), "arena %lld bytes %lld in use %lld/prefix\n",
+			trie->arena->nbytes, trie->arena->nused,
+			trie->arena->nbytes/trie->arena->nnodes);
 	if(trie->nents > 0){
 		s = seprint(s, buf+sizeof(buf), "%d root runes [", trie->nents);
 		for(i = 0; i < trie->nents; i++)
@@ -199,19 +1479,15 @@ ctlread(Req* r)
 			s = seprint(s, buf+sizeof(buf), "%C", roott.ents[i].r);
 		seprint(s, buf+sizeof(buf), "]\n");
 	}
+	qunlock(&trielk);
 	readstr(r, buf);
 	respond(r, nil);
 }
 
 static void
-fsread(Req* r)
+readreq(Req* r)
 {
 	Query*	q;
-	char**	toks;
-	int	ntoks;
-	int	atoks;
-	char*	s;
-	int	pos;
 	File*	f;
 
 	if(r->fid->qid.type&QTDIR){
@@ -223,67 +1499,100 @@ fsread(Req* r)
 		ctlread(r);
 		return;
 	}
-	q = f->aux;
+	if(f == chanf){
+		chanread(r);
+		return;
+	}
+	q = getquery(f);
+	if(q == nil){
+		respond(r, "query removed");
+		return;
+	}
 
 	/* The first read process the query.
 	 * Further reads just retrieve more data,
 	 * if any.
 	 */
 	if(q->expr == nil){
-		atoks = 512;
-		toks = emalloc9p(atoks*sizeof(char*));
-		do {
-			s = estrdup9p(q->text);
-			ntoks = tokenize(s, toks, atoks);
-			if(ntoks == atoks){
-				atoks += 512;
-				toks = erealloc9p(toks, atoks*sizeof(char*));
-				free(s);
-			}
-		}while(ntoks == atoks);
-		pos = 0;
-		if(chatty9p)
-			fprint(2, "compiling %s (%d toks)\n", q->text, ntoks);
-		q->expr = parseexpr(ntoks, toks, &pos);
+		q->expr = compile(q->text);
 		if(q->expr == nil){
-			free(s);
-			free(toks);
-			respond(r, "syntax error");
+			qunlock(&q->lk);
+			putquery(q);
+			responderror(r);
 			return;
 		}
-		if(chatty9p)
-			fprint(2, "evaluating %s (%d toks)\n", q->text, ntoks);
-		evalexpr(trie, q->expr);
-		free(s);
-		free(toks);
-		free(q->text);
-		/* smprintexprval limits the total output to
-		 * at most 64K of text
-		 */
-		q->text = smprintexprval(q->expr);
-		if(chatty9p)
-			fprint(2, "result is [%s]\n", q->text);
+		q->snap = getsnap();
+		evalquery(q->expr, q->snap);
+		q->pos.i = 0;
+		q->pos.off = 0;
 	}
-	/* After the query is process,
-	 * q->text holds the reply.
+	/* After the query is processed, the reply is
+	 * printed as read, from q->expr->rval.
 	 */
-	readstr(r,  q->text);
+	r->ofcall.count = readexprval(q->expr, &q->pos, r->ifcall.offset,
+		r->ofcall.data, r->ifcall.count);
+	qunlock(&q->lk);
+	putquery(q);
 	respond(r, nil);
 }
 
+static void
+reqproc(void* a)
+{
+	Req*	r;
+
+	USED(a);
+	threadsetname("reqproc");
+	for(;;){
+		r = recvp(reqc);
+		if(r->ifcall.type == Tread)
+			readreq(r);
+		else
+			writereq(r);
+	}
+}
+
+/* Reads and writes are handed to the procs,
+ * which respond when done.
+ */
+static void
+fsread(Req* r)
+{
+	sendp(reqc, r);
+}
+
+static void
+fswrite(Req* r)
+{
+	sendp(reqc, r);
+}
+
 static void
 fsclunk(Fid* fid)
 {
 	Query*	q;
 	File*	f;
+	int	done;
 
 	f = fid->file;
 	if(f == nil)
 		return;
-	q = f->aux;
+	if(f == chanf){
+		freechan(fid->aux);
+		fid->aux = nil;
+		return;
+	}
+	q = getquery(f);
 	if(q == nil)
 		return;
-	if(q->expr != nil){
+	done = q->expr != nil;
+	if(done){
+		lock(&querylk);
+		f->aux = nil;
+		unlock(&querylk);
+	}
+	qunlock(&q->lk);
+	if(done){
 		/* the query was already made, destroy the file.
 		 *
 		 * We must incref the file because
@@ -291,17 +1600,16 @@ fsclunk(Fid* fid)
 		 * reference given to it, and we do not.
 		 * We just want the file removed from the tree.
 		 */
-		free(q->text);
-		freeexpr(q->expr);
-		free(q);
-		f->aux = nil;
+		putquery(q);
 		incref(&f->ref);
 		removefile(f);
 	}
+	putquery(q);
 }
 
 static Srv sfs=
 {
+	.open	=	fsopen,
 	.create	=	fscreate,
 	.read	=	fsread,
 	.write	=	fswrite,
@@ -331,7 +1639,8 @@ srvname(char* triefname)
 void
 usage(void)
 {
-	fprint(2, "usage: %s [-abcD] [-s srv] [-m mnt] trie\n", argv0);
+	fprint(2, "usage: %s [-abcDfl] [-p nprocs] [-s srv] [-m mnt] trie\n", argv0);
+	fprint(2, "\ttags written to ctl are seen by queries once written\n");
 	threadexits("usage");
 }
 
@@ -341,11 +1650,12 @@ threadmain(int argc, char* argv[])
 	char*	mnt;
 	char*	srv;
 	int	mflag;
-	Biobuf*	b;
 	char*	user;
+	int	i, nprocs;
 
 	srv = nil;
 	mnt = nil;
+	nprocs = Nprocs;
 	mflag = MREPL|MCREATE;
 	ARGBEGIN{
 	case 'a':
@@ -367,21 +1677,40 @@ threadmain(int argc, char* argv[])
 		debug = 1;
 		chatty9p++;
 		break;
+	case 'f':
+		usefreqs = 1;
+		break;
+	case 'l':
+		lazy = 1;
+		break;
+	case 'p':
+		nprocs = atoi(EARGF(usage()));
+		break;
 	default:
 		usage();
 	}ARGEND;
-	if(argc != 1)
+	if(argc != 1 || nprocs < 1)
 		usage();
 
 	tfname = argv[0];
 	ttfname = smprint("%s.new", tfname);
-	b = Bopen(tfname, OREAD);
-	if(b == nil)
-		sysfatal("%s: %r", tfname);
-	trie = rdtrie(b);
-	Bterm(b);
+	jfname = smprint("%s.log", tfname);
+	tjfname = smprint("%s.new", jfname);
+	if(recover() < 0)
+		sysfatal("%r");
+	trie = loadtrie();
 	if(trie == nil)
 		sysfatal("%s: %r", tfname);
+	// the journal is left for compaction to fold in.
+	jsize = replay();
+	jseq = jsize;
+	publish(nil);
+	if(access(jfname, AEXIST) < 0){
+		if(rejournal(fileid(tfname)) < 0)
+			sysfatal("%r");
+	} else if((jfd = open(jfname, OWRITE)) < 0)
+		sysfatal("%s: %r", jfname);
+	tsize = filelen(tfname);
 
 	if(srv == nil && mnt == nil){
 		mnt = "/mnt/tags";
@@ -392,6 +1721,14 @@ threadmain(int argc, char* argv[])
 	sfs.tree =  alloctree(nil, nil, DMDIR|0777, nil);
 	user = getuser();
 	ctlf = createfile(sfs.tree->root, "ctl", user, 0666, nil);
+	chanf = createfile(sfs.tree->root, "queries", user, 0666, nil);
+	// before the procs may race to do it.
+	setsinit();
+	reqc = chancreate(sizeof(Req*), nprocs);
+	for(i = 0; i < nprocs; i++)
+		proccreate(reqproc, nil, Stack);
+	compactc = chancreate(sizeof(ulong), 1);
+	proccreate(compactproc, nil, Stack);
 	threadpostmountsrv(&sfs, srv, mnt, mflag);
 	threadexits(nil);
 }
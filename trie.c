@@ -1,13 +1,19 @@
 #include <u.h>
 #include <libc.h>
 #include <bio.h>
+#include <fcall.h>
 #include "util.h"
+#include "arena.h"
+#include "post.h"
+#include "docs.h"
 #include "trie.h"
 
 /* Trie supporting search from word to
  * list of uvlong (Qid.paths for files)
  * values (uvlongs) can be removed, but keys
  * are never removed.
+ * Nodes keep doc ids for the values, given
+ * by the Docs in the root.
  */
 
 long ntries;
@@ -15,45 +21,212 @@ long maxvals;
 long nvaltries;
 
 int	warntries = 1;
+int	usearenas = 1;
+int	usefreqs;
 
-Trie	roott;	// profiling. Used entries at the root node.
+Trie	roott;	// profiling. First runes of the keys put.
 
-Trie*	
-alloctrie(void)
+static int	loadnode(Timg* im, Trie* t);
+
+/*
+ * Nodes and their arrays for a trie come from a single arena
+ * (unless usearenas is false), so there are no malloc headers
+ * per node and the trie is released at once.
+ */
+
+static Trie*
+newtrie(Arena* a)
 {
 	Trie*	t;
 
-	t = emallocz(sizeof(*t), 1);
+	t = aalloc(a, sizeof(*t));
+	memset(t, 0, sizeof(*t));
+	if(a != nil)
+		a->nnodes++;
+	t->arena = a;
 	ntries++;
 	if(warntries && (ntries%50000) == 0)
 		fprint(2, "alloctrie: > %ld prefixes\n", ntries);
 	return t;
 }
 
-void	
-freetrie(Trie* t)
+Trie*	
+alloctrie(void)
+{
+	Trie*	t;
+
+	t = newtrie(usearenas ? newarena() : nil);
+	t->docs = newdocs();
+	t->counts = usefreqs;
+	return t;
+}
+
+static void
+_freetrie(Trie* t)
 {
 	int	i;
 
 	if(t != nil){
 		ntries--;
-		free(t->vals);
-		free(t->svals);
+		freepost(nil, &t->post);
+		freefreq(nil, &t->freq);
 		for(i = 0; i < t->nents; i++)
-			freetrie(t->ents[i].t);
+			_freetrie(t->ents[i].t);
 		free(t->ents);
+		free(t->pfx);
+		free(t->dir);
+		freedocs(t->docs);
+		closeimg(t->img);
 		free(t);
 	}
 }
 
+/* t must be the root when using arenas.
+ */
+void	
+freetrie(Trie* t)
+{
+	if(t != nil && t->arena != nil){
+		ntries -= t->arena->nnodes;
+		freedocs(t->docs);
+		closeimg(t->img);
+		freearena(t->arena);
+	} else
+		_freetrie(t);
+}
+
+static void
+freenode(Trie* t)
+{
+	Arena*	a;
+
+	a = t->arena;
+	ntries--;
+	freepost(a, &t->post);
+	freefreq(a, &t->freq);
+	afree(a, t->ents, tcap(t->nents)*sizeof(Tent));
+	afree(a, t->pfx, t->npfx*sizeof(Rune));
+	afree(a, t->dir, Ndir*sizeof(ushort));
+	afree(a, t, sizeof(*t));
+	if(a != nil)
+		a->nnodes--;
+}
+
+/* Nodes keep in pfx the runes following
+ * the one in the edge leading to them, so
+ * single child chains take a single node.
+ */
+static Rune*
+newpfx(Arena* a, int n)
+{
+	if(n == 0)
+		return nil;
+	return aalloc(a, n*sizeof(Rune));
+}
+
+static void
+setpfx(Trie* t, Rune* r, int n)
+{
+	Rune*	p;
+
+	p = newpfx(t->arena, n);
+	memmove(p, r, n*sizeof(Rune));
+	afree(t->arena, t->pfx, t->npfx*sizeof(Rune));
+	t->pfx = p;
+	t->npfx = n;
+}
+
+/* Number of runes in t's path matching those at *kp,
+ * which is advanced past them.
+ */
+static int
+matchpfx(Trie* t, char** kp)
+{
+	int	i, nc;
+	Rune	r;
+	char*	k;
+
+	k = *kp;
+	for(i = 0; i < t->npfx && *k != 0; i++){
+		nc = chartorune(&r, k);
+		if(tolowerrune(r) != t->pfx[i])
+			break;
+		k += nc;
+	}
+	*kp = k;
+	return i;
+}
+
+/* Cut the path of t after n runes, returning
+ * the new node for the first part.
+ */
+static Trie*
+splittrie(Trie* t, int n)
+{
+	Trie*	m;
+
+	m = newtrie(t->arena);
+	m->gen = t->gen;
+	setpfx(m, t->pfx, n);
+	m->ents = talloc(t->arena, 1, sizeof(Tent));
+	m->ents[0].r = t->pfx[n];
+	m->ents[0].t = t;
+	m->nents = 1;
+	setpfx(t, t->pfx+n+1, t->npfx-n-1);
+	return m;
+}
+
+/* Old databases have a node per rune.
+ * Fold a single child node without values into its
+ * child, which is assumed to be already folded.
+ */
+static Trie*
+foldtrie(Trie* t)
+{
+	Trie*	c;
+	Rune*	p;
+	int	n;
+
+	if(t->nents != 1 || t->post.n != 0)
+		return t;
+	c = t->ents[0].t;
+	n = t->npfx + 1 + c->npfx;
+	if(n > Npfx)
+		return t;
+	p = newpfx(t->arena, n);
+	memmove(p, t->pfx, t->npfx*sizeof(Rune));
+	p[t->npfx] = t->ents[0].r;
+	memmove(p+t->npfx+1, c->pfx, c->npfx*sizeof(Rune));
+	setpfx(c, p, n);
+	afree(t->arena, p, n*sizeof(Rune));
+	freenode(t);
+	return c;
+}
+
+/*
+ * Children are kept sorted by rune. Small nodes are
+ * scanned, medium ones use binary search, and dense ones
+ * (the root and a few others) index runes below Ndir
+ * through dir, which holds 1 + their position in ents.
+ */
+
 static int
 getkey(Trie* t, Rune k)
 {
 	int	h,l,m;
 
+	k = tolowerrune(k);
+	if(t->dir != nil && k >= 0 && k < Ndir)
+		return t->dir[k] - 1;
+	if(t->nents <= Nlinear){
+		for(m = 0; m < t->nents && t->ents[m].r < k; m++)
+			;
+		if(m < t->nents && t->ents[m].r == k)
+			return m;
+		return -1;
+	}
 	h = t->nents;
 	l = 0;
-	k = tolowerrune(k);
 	for(;;){
 		if(l >= h)
 			return -1;
@@ -68,13 +241,17 @@ getkey(Trie* t, Rune k)
 	}
 }
 
-static int
-ecmp(const void* r1, const void* r2)
+static void
+indexents(Trie* t)
 {
-	const Tent* e1 = r1;
-	const Tent* e2 = r2;
+	int	i;
 
-	return e1->r - e2->r;
+	if(t->dir == nil)
+		t->dir = aalloc(t->arena, Ndir*sizeof(ushort));
+	memset(t->dir, 0, Ndir*sizeof(ushort));
+	for(i = 0; i < t->nents && t->ents[i].r < Ndir; i++)
+		if(t->ents[i].r >= 0)
+			t->dir[t->ents[i].r] = i + 1;
 }
 
 /* called with root as t
@@ -83,56 +260,112 @@ ecmp(const void* r1, const void* r2)
 static int
 putkey(Trie* t, Rune k)
 {
+	int	h, l, m;
+
 	k = tolowerrune(k);
-	if(t->nents == t->aents){
-		t->aents += Incr;
-		t->ents = erealloc(t->ents, t->aents*sizeof(Tent));
+	l = 0;
+	h = t->nents;
+	while(l < h){
+		m = l + (h - l)/2;
+		if(t->ents[m].r < k)
+			l = m + 1;
+		else
+			h = m;
+	}
+	t->ents = tgrow(t->arena, t->ents, t->nents, sizeof(Tent));
+	memmove(t->ents+l+1, t->ents+l, (t->nents-l)*sizeof(Tent));
+	t->ents[l].r = k;
+	t->ents[l].t = nil;
+	if(t != &roott){
+		t->ents[l].t = newtrie(t->arena);
+		t->ents[l].t->gen = t->gen;
 	}
-	t->ents[t->nents].r = k;
-	if(t != &roott)
-		t->ents[t->nents].t = alloctrie();
 	t->nents++;
-	qsort(t->ents, t->nents, sizeof(Tent), ecmp);
-	return getkey(t, k);
+	if(t->dir != nil || t->nents >= Ndirect)
+		indexents(t);
+	return l;
 }
 
 static int
-putsval(Trie* t, long v)
+putval(Trie* t, u32int v, int counts)
 {
-	int	i;
-
-	for(i = 0; i < t->nsvals; i++)
-		if(t->svals[i] == v)
-			return 0;
-	if((t->nsvals%(2*Incr)) == 0){
-		t->svals = erealloc(t->svals, (t->nsvals+2*Incr)*sizeof(ulong));
+	if(!postadd(t->arena, &t->post, v)){
+		if(counts)
+			freqadd(t->arena, &t->freq, v, 1);
+		return 0;
 	}
-	t->svals[t->nsvals++] = v;
-	if(t->nsvals + t->nvals > maxvals)
-		maxvals = t->nsvals + t->nvals;
+	if(t->post.n == 1)
+		nvaltries++;
+	if(t->post.n > maxvals)
+		maxvals = t->post.n;
 	return 1;
 }
 
-static int
-putval(Trie* t, vlong v)
+/*
+ * Versions. trienext freezes a trie, to be searched by
+ * others with triefind, and returns the root for the next
+ * version, sharing the nodes. trieput copies the nodes of
+ * older versions before changing them, and their lists copy
+ * the blocks they change (see post.c). What the new version
+ * no longer uses is retired in the arena (see aretire).
+ * Once a version and the older ones are no longer used,
+ * freeversion frees what was retired making the next one.
+ * Tries with versions must use arenas.
+ */
+
+/* A copy of c for the version gen, to change in place.
+ * c is kept for older versions, retired from this one.
+ */
+static Trie*
+cownode(Trie* c, int gen)
 {
-	int	i;
-	long	sv;
+	Arena*	a;
+	Trie*	n;
 
-	if(t->nvals == 0)
-		nvaltries++;
-	sv = v;
-	if(v == (vlong)sv)		// many qids fit in a long
-		return putsval(t, sv);	// use long for them.
-	for(i = 0; i < t->nvals; i++)
-		if(t->vals[i] == v)
-			return 0;
-	if((t->nvals%(2*Incr)) == 0)
-		t->vals = erealloc(t->vals, (t->nvals+2*Incr)*sizeof(uvlong));
-	t->vals[t->nvals++] = v;
-	if(t->nsvals + t->nvals > maxvals)
-		maxvals = t->nsvals + t->nvals;
-	return 1;
+	a = c->arena;
+	n = aalloc(a, sizeof(*n));
+	*n = *c;
+	n->gen = gen;
+	n->ents = talloc(a, c->nents, sizeof(Tent));
+	if(c->nents > 0)
+		memmove(n->ents, c->ents, c->nents*sizeof(Tent));
+	n->pfx = newpfx(a, c->npfx);
+	if(c->npfx > 0)
+		memmove(n->pfx, c->pfx, c->npfx*sizeof(Rune));
+	if(c->dir != nil){
+		n->dir = aalloc(a, Ndir*sizeof(ushort));
+		memmove(n->dir, c->dir, Ndir*sizeof(ushort));
+	}
+	postshare(&n->post);
+	freqshare(&n->freq);
+	aretire(a, c->ents, tcap(c->nents)*sizeof(Tent));
+	aretire(a, c->pfx, c->npfx*sizeof(Rune));
+	aretire(a, c->dir, Ndir*sizeof(ushort));
+	aretire(a, c, sizeof(*c));
+	return n;
+}
+
+/* t must be the root, and is not to be changed after.
+ */
+Trie*
+trienext(Trie* t)
+{
+	Trie*	n;
+
+	assert(t->arena != nil);
+	n = cownode(t, t->gen+1);
+	t->docs = frozendocs(n->docs);
+	return n;
+}
+
+/* Frees what only the version t used, given what
+ * was retired making the next one.
+ */
+void
+freeversion(Trie* t, Adead* d)
+{
+	freedocs(t->docs);
+	afreedead(t->arena, d);
 }
 
 void	
@@ -140,11 +373,19 @@ trieput(Trie* t, char* k, vlong v)
 {
 	int	ti;
 	Rune	r;
-	int	nc;
+	int	i, n;
 	char*	uk;
 	int	newv;
+	Trie*	c;
+	Rune*	p;
+	u32int	id;
+	Timg*	im;
+	int	counts;
 
 	uk = k;
+	im = t->img;
+	counts = t->counts;
+	id = docid(t->docs, v);
 	if(*k != 0){
 		chartorune(&r, k);
 		if(getkey(&roott, r) < 0)
@@ -153,16 +394,43 @@ trieput(Trie* t, char* k, vlong v)
 	for(;;){
 		if(*k == 0)
 			break;
-		nc = chartorune(&r, k);
+		k += chartorune(&r, k);
 		ti = getkey(t, r);
-		if(ti < 0)
+		if(ti < 0){
+			// a new node keeps the rest of the key, or Npfx runes of it.
 			ti = putkey(t, r);
-		t = t->ents[ti].t;
-		k += nc;
+			t = t->ents[ti].t;
+			n = utflen(k);
+			if(n > Npfx)
+				n = Npfx;
+			p = newpfx(t->arena, n);
+			for(i = 0; i < n; i++){
+				k += chartorune(&r, k);
+				p[i] = tolowerrune(r);
+			}
+			t->pfx = p;
+			t->npfx = n;
+			continue;
+		}
+		c = t->ents[ti].t;
+		if(c->gen != t->gen){
+			c = cownode(c, t->gen);
+			t->ents[ti].t = c;
+		}
+		if(c->imgoff != 0 && loadnode(im, c) < 0){
+			fprint(2, "trieput: tag %s: %r\n", uk);
+			return;
+		}
+		i = matchpfx(c, &k);
+		if(i < c->npfx){
+			c = splittrie(c, i);
+			t->ents[ti].t = c;
+		}
+		t = c;
 	}
-	newv = putval(t, v);
-	if(newv && ((t->nvals+t->nsvals)%1000) == 0)
-		fprint(2, "trieput: tag %s: > %d files\n", uk, t->nvals+t->nsvals);
+	newv = putval(t, id, counts);
+	if(newv && (t->post.n%1000) == 0)
+		fprint(2, "trieput: tag %s: > %d files\n", uk, t->post.n);
 }
 
 Trie*	
@@ -170,22 +438,59 @@ trieget(Trie* t, char* k)
 {
 	int	ti;
 	Rune	r;
-	int	nc;
+	Timg*	im;
 
-	if(*k != 0){
-		chartorune(&r, k);
-		if(getkey(&roott, r) < 0)
-			putkey(&roott, r);
+	/* roott is profiled by trieput only, so lookups in tries
+	 * read whole may run at once. Tries from opentrie load
+	 * nodes here, and lookups need the lock of trieput;
+	 * triefind does not load them.
+	 */
+	im = t->img;
+	for(;;){
+		if(*k == 0)
+			return t;
+		k += chartorune(&r, k);
+		ti = getkey(t, r);
+		if(ti < 0)
+			return nil;
+		t = t->ents[ti].t;
+		if(t->imgoff != 0 && loadnode(im, t) < 0)
+			return nil;
+		if(matchpfx(t, &k) < t->npfx)
+			return nil;
 	}
+}
+
+static vlong	imgwalk(Timg* im, vlong off, char* k);
+
+/* Like trieget, but nodes not loaded are searched in the
+ * image instead, so frozen versions may be searched by many
+ * at once. Returns the node for k, or nil with *offp set
+ * to its offset in t->img, or to -1 if k is not there.
+ */
+Trie*
+triefind(Trie* t, char* k, vlong* offp)
+{
+	int	ti;
+	Rune	r;
+	Timg*	im;
+
+	*offp = -1;
+	im = t->img;
 	for(;;){
 		if(*k == 0)
 			return t;
-		nc = chartorune(&r, k);
+		k += chartorune(&r, k);
 		ti = getkey(t, r);
 		if(ti < 0)
 			return nil;
 		t = t->ents[ti].t;
-		k += nc;
+		if(t->imgoff != 0){
+			*offp = imgwalk(im, t->imgoff, k);
+			return nil;
+		}
+		if(matchpfx(t, &k) < t->npfx)
+			return nil;
 	}
 }
 
@@ -206,7 +511,7 @@ rdline(Biobuf* b, int* lno, char* tag)
 }
 
 static Trie*	
-_rdtrie(Biobuf* b, int* lno)
+_rdtrie(Biobuf* b, int* lno, Arena* a, Docs* d)
 {
 	char*	ln;
 	Trie*	t;
@@ -216,7 +521,7 @@ _rdtrie(Biobuf* b, int* lno)
 	int	nents;
 	int	i;
 
-	t = alloctrie();
+	t = newtrie(a);
 	ln = rdline(b, lno, "values");
 	if(ln == nil)
 		goto fail;
@@ -224,7 +529,7 @@ _rdtrie(Biobuf* b, int* lno)
 		v = strtoull(s, &n, 16);
 		if (v == 0LL)
 			break;
-		putval(t, v);
+		putval(t, docid(d, v), usefreqs);
 	}
 	free(ln);
 	ln = rdline(b, lno, "nents");
@@ -236,84 +541,881 @@ _rdtrie(Biobuf* b, int* lno)
 		fprint(2, "rdtree: bad entry: %d ents: aborting\n", nents);
 		goto fail;
 	}
-	t->ents = emallocz(nents*sizeof(Tent), 1);
-	t->aents = nents;
+	t->ents = talloc(a, nents, sizeof(Tent));
 	for(i = 0; i < nents; i++){
 		ln = rdline(b, lno, "rune");
 		if(ln == nil)
 			goto fail;
 		chartorune(&(t->ents[i].r), ln);
 		free(ln);
-		t->ents[i].t = _rdtrie(b, lno);
+		t->ents[i].t = _rdtrie(b, lno, a, d);
 		if(t->ents[i].t == nil)
 			goto fail;
+		t->ents[i].t = foldtrie(t->ents[i].t);
 		t->nents++;
 	}
+	if(t->nents >= Ndirect)
+		indexents(t);
 	return t;
 fail:
-	freetrie(t);
+	if(a == nil)
+		freetrie(t);
 	return nil;
 }
 
+/*
+ * Binary database format (version Tvers).
+ * All integers are little endian, offsets are from the
+ * start of the file, and nodes are written children first,
+ * so the image can be mapped and searched in place:
+ *
+ *	header:	magic[8] "tagtrie\n" vers[4] flags[4]
+ *	docs:	ndocs[4] ndocs * qid[8]	if flags has Fdocids
+ *	node:	kind[1] nents[4] nvals[4] npfx[2]
+ *		npfx * rune[4]		the node pfx
+ *		nents * (rune[4] off[8])	sorted by rune
+ *		nvals * val[8]		if kind is Praw
+ *		nbytes[4] varint[nbytes]	if kind is Pdelta
+ *		nfbytes[4] varint[nfbytes]	if flags has Fcounts
+ *	trailer:	nnodes[8] root[8]
+ *
+ * Pdelta values are sorted, and coded as varints
+ * for the first one and the deltas for the rest.
+ * Counts are varint pairs for values put more than
+ * once: the delta from the previous one, and the count.
+ * With Fdocids, values are doc ids, indexes in the
+ * docs qids, else they are the qids themselves.
+ * Version 1 nodes lack npfx and the pfx runes.
+ */
+
+typedef struct Inode Inode;
+
+struct Inode {
+	vlong	off;	// of the node in the image
+	uchar*	pfx;
+	int	npfx;
+	uchar*	ents;
+	int	nents;
+	int	kind;
+	uchar*	vals;
+	int	nvals;
+	int	nvbytes;	// size of vals
+	uchar*	freqs;	// counts, if Fcounts
+	int	nfbytes;
+};
+
+static char	tmagic[] = "tagtrie\n";
+
+static int
+imgnode(Timg* im, vlong off, Inode* n)
+{
+	uchar*	p;
+	vlong	sz;
+	int	hsz;
+
+	hsz = Tnodesz;
+	if(im->vers == 1)
+		hsz = Tnode1sz;
+	if(off < Thdrsz || off > im->size - Tlrsz - hsz){
+		werrstr("bad node offset %lld", off);
+		return -1;
+	}
+	p = im->data + off;
+	n->off = off;
+	n->kind = p[0];
+	if(n->kind != Praw && n->kind != Pdelta){
+		werrstr("node %lld: unknown value kind %d", off, p[0]);
+		return -1;
+	}
+	n->nents = GBIT32(p+1);
+	n->nvals = GBIT32(p+5);
+	n->npfx = 0;
+	if(im->vers > 1)
+		n->npfx = GBIT16(p+9);
+	sz = (vlong)n->npfx*Trunesz + (vlong)n->nents*Tentsz;
+	if(n->kind == Pdelta)
+		sz += 4;
+	else
+		sz += (vlong)n->nvals*Tvalsz;
+	if(n->nents < 0 || n->nvals < 0 || sz > im->size - Tlrsz - hsz - off){
+		werrstr("node %lld: bad size", off);
+		return -1;
+	}
+	n->pfx = p + hsz;
+	n->ents = n->pfx + n->npfx*Trunesz;
+	n->vals = n->ents + n->nents*Tentsz;
+	n->nvbytes = n->nvals*Tvalsz;
+	if(n->kind == Pdelta){
+		n->nvbytes = GBIT32(n->vals);
+		n->vals += 4;
+		if(n->nvbytes < 0 || n->nvbytes > im->size - Tlrsz - hsz - off - sz){
+			werrstr("node %lld: bad size", off);
+			return -1;
+		}
+	}
+	n->freqs = nil;
+	n->nfbytes = 0;
+	if(im->flags&Fcounts){
+		if(n->kind == Pdelta)
+			sz += n->nvbytes;
+		if(sz + 4 > im->size - Tlrsz - hsz - off){
+			werrstr("node %lld: bad size", off);
+			return -1;
+		}
+		n->freqs = n->vals + n->nvbytes + 4;
+		n->nfbytes = GBIT32(n->freqs - 4);
+		if(n->nfbytes < 0 || n->nfbytes > im->size - Tlrsz - hsz - off - sz - 4){
+			werrstr("node %lld: bad size", off);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Offset of the child i of n. Children are written
+ * before their parent, so a child not below it comes
+ * from a bad image, and might lead back to the parent.
+ */
+static vlong
+imgchild(Inode* n, int i)
+{
+	vlong	off;
+
+	off = GBIT64(n->ents + i*Tentsz + 4);
+	if(off >= n->off){
+		werrstr("node %lld: bad child offset %lld", n->off, off);
+		return -1;
+	}
+	return off;
+}
+
+static int
+chkimg(Timg* im)
+{
+	uchar*	p;
+	vlong	n;
+
+	if(im->size < Thdrsz+Tlrsz || memcmp(im->data, tmagic, 8) != 0){
+		werrstr("not a binary trie");
+		return -1;
+	}
+	p = im->data;
+	im->vers = GBIT32(p+8);
+	if(im->vers < 1 || im->vers > Tvers){
+		werrstr("trie version %d not supported", im->vers);
+		return -1;
+	}
+	im->flags = GBIT32(p+12);
+	im->docs = nil;
+	if(im->flags&Fdocids){
+		n = -1;
+		if(im->size >= Thdrsz+Tdocsz+Tlrsz)
+			n = GBIT32(p+Thdrsz);
+		if(n < 0 || n*Dqidsz > im->size - Thdrsz - Tdocsz - Tlrsz){
+			werrstr("bad doc id table");
+			return -1;
+		}
+		im->docs = imgdocs(p+Thdrsz+Tdocsz, n);
+	}
+	p = im->data + im->size - Tlrsz;
+	im->nnodes = GBIT64(p);
+	im->root = GBIT64(p+8);
+	return 0;
+}
+
+Timg*
+openimg(char* fname)
+{
+	Timg*	im;
+
+	im = emallocz(sizeof(*im), 1);
+	im->data = mapfile(fname, &im->size);
+	if(im->data == nil){
+		free(im);
+		return nil;
+	}
+	if(chkimg(im) < 0){
+		closeimg(im);
+		return nil;
+	}
+	if((im->flags&Fdocids) == 0){
+		werrstr("%s: no doc ids, old version", fname);
+		closeimg(im);
+		return nil;
+	}
+	return im;
+}
+
+void
+closeimg(Timg* im)
+{
+	if(im != nil){
+		unmapfile(im->data, im->size);
+		freedocs(im->docs);
+		free(im);
+	}
+}
+
+/* The offset of the node for k, searching from
+ * the node at off with its pfx, or -1.
+ */
+static vlong
+imgwalk(Timg* im, vlong off, char* k)
+{
+	Inode	n;
+	Rune	r, er;
+	int	h, l, m;
+	int	i;
+
+	for(;;){
+		if(imgnode(im, off, &n) < 0)
+			return -1;
+		for(i = 0; i < n.npfx; i++){
+			if(*k == 0)
+				return -1;
+			k += chartorune(&r, k);
+			if(tolowerrune(r) != GBIT32(n.pfx + i*Trunesz))
+				return -1;
+		}
+		if(*k == 0)
+			return off;
+		k += chartorune(&r, k);
+		r = tolowerrune(r);
+		l = 0;
+		h = n.nents;
+		for(;;){
+			if(l >= h)
+				return -1;
+			m = l + (h - l)/2;
+			er = GBIT32(n.ents + m*Tentsz);
+			if(er == r)
+				break;
+			if(er < r)
+				l = m + 1;
+			else
+				h = m;
+		}
+		off = imgchild(&n, m);
+		if(off < 0)
+			return -1;
+	}
+}
+
+/* Like trieget, but for a database image.
+ * Returns the offset of the node for k, or -1.
+ */
+vlong
+imgget(Timg* im, char* k)
+{
+	return imgwalk(im, im->root, k);
+}
+
+/* Values for n as doc ids. Images without them
+ * keep qids, which get ids from d as they are found.
+ */
+static int
+nodevals(Timg* im, Inode* n, Docs* d, u32int* v)
+{
+	uchar*	p;
+	uchar*	e;
+	uvlong	x, dx;
+	int	i, nc;
+
+	x = 0;
+	p = n->vals;
+	e = p + n->nvbytes;
+	for(i = 0; i < n->nvals; i++){
+		if(n->kind == Praw)
+			x = GBIT64(n->vals + i*Tvalsz);
+		else {
+			nc = getvarint(p, e, &dx);
+			if(nc < 0){
+				werrstr("bad value at %lld", (vlong)(p - n->vals));
+				break;
+			}
+			p += nc;
+			x += dx;
+		}
+		if((im->flags&Fdocids) == 0)
+			v[i] = docid(d, x);
+		else if(x < im->docs->n)
+			v[i] = x;
+		else {
+			werrstr("bad doc id %llud", x);
+			break;
+		}
+	}
+	return i;
+}
+
+static int
+vcmp(const void* a1, const void* a2)
+{
+	const u32int* v1 = a1;
+	const u32int* v2 = a2;
+
+	if(*v1 < *v2)
+		return -1;
+	return *v1 > *v2;
+}
+
+/* Sorts the n values in v removing duplicates.
+ */
+static int
+sortvals(u32int* v, int n)
+{
+	int	i, j;
+
+	if(n == 0)
+		return 0;
+	qsort(v, n, sizeof(u32int), vcmp);
+	for(i = j = 1; i < n; i++)
+		if(v[i] != v[j-1])
+			v[j++] = v[i];
+	return j;
+}
+
+/* Doc ids for the node at off, in an image from openimg.
+ * If v is not nil, it must have room for all of them, and
+ * gets them sorted.
+ * Returns the number of values.
+ */
+int
+imgvals(Timg* im, vlong off, u32int* v)
+{
+	Inode	n;
+
+	if(imgnode(im, off, &n) < 0)
+		return 0;
+	if(v == nil)
+		return n.nvals;
+	if(n.kind == Praw)
+		return sortvals(v, nodevals(im, &n, nil, v));
+	return nodevals(im, &n, nil, v);
+}
+
+/* Adds the counts for n to f.
+ */
+static int
+nodefreq(Inode* n, Arena* a, Pfreq* f)
+{
+	uchar*	p;
+	uchar*	e;
+	uvlong	x, dx, c;
+	int	nc;
+
+	x = 0;
+	p = n->freqs;
+	e = p + n->nfbytes;
+	while(p < e){
+		nc = getvarint(p, e, &dx);
+		if(nc < 0)
+			goto fail;
+		p += nc;
+		nc = getvarint(p, e, &c);
+		if(nc < 0 || c < 2)
+			goto fail;
+		p += nc;
+		x += dx;
+		freqadd(a, f, x, c-1);
+	}
+	return 0;
+fail:
+	werrstr("bad count at %lld", (vlong)(p - n->freqs));
+	return -1;
+}
+
+/* Counts for the values of the node at off, added to f.
+ * Images without them count values once.
+ */
+int
+imgfreq(Timg* im, vlong off, Pfreq* f)
+{
+	Inode	n;
+
+	if(imgnode(im, off, &n) < 0)
+		return -1;
+	return nodefreq(&n, nil, f);
+}
+
+/* Sets the pfx, values, and counts of t from n.
+ */
+static int
+setnode(Timg* im, Inode* n, Trie* t, Docs* d)
+{
+	Arena*	a;
+	int	nv;
+	u32int*	v;
+
+	a = t->arena;
+	t->pfx = newpfx(a, n->npfx);
+	for(; t->npfx < n->npfx; t->npfx++)
+		t->pfx[t->npfx] = GBIT32(n->pfx + t->npfx*Trunesz);
+	if(n->nvals > 0){
+		v = emallocz(n->nvals*sizeof(u32int), 0);
+		nv = nodevals(im, n, d, v);
+		if(n->kind == Praw || (im->flags&Fdocids) == 0)
+			nv = sortvals(v, nv);
+		postset(a, &t->post, v, nv);
+		free(v);
+		if(nodefreq(n, a, &t->freq) < 0)
+			return -1;
+		nvaltries++;
+		if(nv > maxvals)
+			maxvals = nv;
+	}
+	return 0;
+}
+
+static Trie*
+imgtrie(Timg* im, vlong off, Arena* a, Docs* d)
+{
+	Trie*	t;
+	Inode	n;
+	int	i;
+
+	if(imgnode(im, off, &n) < 0)
+		return nil;
+	t = newtrie(a);
+	if(setnode(im, &n, t, d) < 0){
+		if(a == nil)
+			freetrie(t);
+		return nil;
+	}
+	t->ents = talloc(a, n.nents, sizeof(Tent));
+	for(i = 0; i < n.nents; i++){
+		t->ents[i].r = GBIT32(n.ents + i*Tentsz);
+		off = imgchild(&n, i);
+		t->ents[i].t = nil;
+		if(off >= 0)
+			t->ents[i].t = imgtrie(im, off, a, d);
+		if(t->ents[i].t == nil){
+			if(a == nil)
+				freetrie(t);
+			return nil;
+		}
+		t->ents[i].t = foldtrie(t->ents[i].t);
+		t->nents++;
+	}
+	if(t->nents >= Ndirect)
+		indexents(t);
+	return t;
+}
+
+/* Gives d the doc ids of im, which must be new.
+ */
+static int
+imgdocids(Timg* im, Docs* d)
+{
+	u32int	i;
+
+	for(i = 0; i < im->docs->n; i++)
+		if(docid(d, docqid(im->docs, i)) != i){
+			werrstr("doc id table: qid %llux repeated", docqid(im->docs, i));
+			return -1;
+		}
+	return 0;
+}
+
+static Trie*
+rdtrieimg(Biobuf* b, Arena* a, Docs* d)
+{
+	Timg	im;
+	long	n, nr;
+	long	asz;
+	Trie*	t;
+
+	asz = 64*1024;
+	im.data = emallocz(asz, 0);
+	memmove(im.data, tmagic, 8);
+	for(n = 8;; n += nr){
+		if(n == asz){
+			asz *= 2;
+			im.data = erealloc(im.data, asz);
+		}
+		nr = Bread(b, im.data+n, asz-n);
+		if(nr < 0){
+			free(im.data);
+			return nil;
+		}
+		if(nr == 0)
+			break;
+	}
+	im.size = n;
+	t = nil;
+	if(chkimg(&im) < 0){
+		free(im.data);
+		return nil;
+	}
+	if(im.docs != nil && imgdocids(&im, d) < 0)
+		goto done;
+	t = imgtrie(&im, im.root, a, d);
+	if(t != nil && (im.flags&Fcounts))
+		t->counts = 1;
+done:
+	freedocs(im.docs);
+	free(im.data);
+	return t;
+}
+
+/* Reads either a binary database or
+ * one in the old text format.
+ */
 Trie*
 rdtrie(Biobuf* b)
 {
 	int	lno;
 	Trie*	t;
+	Arena*	a;
+	Docs*	d;
+	char	magic[8];
+
 	lno = 0;
+	d = newdocs();
+	a = nil;
+	if(usearenas)
+		a = newarena();
 	// do not warn about so many tries created while reading
 	// a database. Its creator already noticed.
 	warntries = 0;
-	t = _rdtrie(b, &lno);
+	if(Bread(b, magic, 8) == 8 && memcmp(magic, tmagic, 8) == 0)
+		t = rdtrieimg(b, a, d);
+	else {
+		Bseek(b, 0, 0);
+		t = _rdtrie(b, &lno, a, d);
+	}
 	warntries = 1;
+	if(t == nil){
+		freedocs(d);
+		if(a != nil){
+			ntries -= a->nnodes;
+			freearena(a);
+		}
+	} else {
+		t->docs = d;
+		t->counts |= usefreqs;
+	}
+	return t;
+}
+
+/*
+ * Tries from opentrie keep their image mapped, and load
+ * nodes from it as trieput and trieget get to them.
+ * Nodes not loaded have just imgoff, their offset in the
+ * image, and are written by copying them from there.
+ * Nodes in the image are not folded as they load, so
+ * images of version 1 are read whole. printtrie and
+ * wrtrietext want tries read whole too.
+ */
+
+/* Loads the node t, leaving its children to load.
+ */
+static int
+loadnode(Timg* im, Trie* t)
+{
+	Inode	n;
+	Trie*	c;
+	int	i, w;
+
+	if(imgnode(im, t->imgoff, &n) < 0)
+		return -1;
+	for(i = 0; i < n.nents; i++)
+		if(imgchild(&n, i) < 0)
+			return -1;
+	w = warntries;
+	warntries = 0;
+	if(setnode(im, &n, t, nil) < 0){
+		warntries = w;
+		return -1;
+	}
+	t->ents = talloc(t->arena, n.nents, sizeof(Tent));
+	for(i = 0; i < n.nents; i++){
+		c = newtrie(t->arena);
+		c->gen = t->gen;
+		c->imgoff = imgchild(&n, i);
+		t->ents[i].r = GBIT32(n.ents + i*Tentsz);
+		t->ents[i].t = c;
+	}
+	t->nents = n.nents;
+	if(t->nents >= Ndirect)
+		indexents(t);
+	t->imgoff = 0;
+	warntries = w;
+	return 0;
+}
+
+/* Opens the database in fname, loading nodes as they are
+ * used. Databases without an image to keep are read whole.
+ */
+Trie*
+opentrie(char* fname)
+{
+	Timg*	im;
+	Biobuf*	b;
+	Trie*	t;
+	Docs*	d;
+
+	im = openimg(fname);
+	if(im == nil || im->vers < 2){
+		closeimg(im);
+		b = Bopen(fname, OREAD);
+		if(b == nil)
+			return nil;
+		t = rdtrie(b);
+		Bterm(b);
+		return t;
+	}
+	d = newdocs();
+	if(imgdocids(im, d) < 0){
+		freedocs(d);
+		closeimg(im);
+		return nil;
+	}
+	t = newtrie(usearenas ? newarena() : nil);
+	t->docs = d;
+	t->counts = usefreqs || (im->flags&Fcounts) != 0;
+	t->img = im;
+	t->imgoff = im->root;
+	if(loadnode(im, t) < 0){
+		freetrie(t);
+		return nil;
+	}
 	return t;
 }
 
+/* Writes the node at off in im, not loaded in the trie
+ * written, and its children. Doc ids are those of the trie,
+ * so values and counts are copied as they are.
+ */
+static vlong
+_wrimg(Biobuf* b, Timg* im, int counts, vlong off, vlong* offp, long* nnodes)
+{
+	uchar	buf[Tentsz];
+	vlong*	offs;
+	Inode	n;
+	int	i, nb;
+
+	if(imgnode(im, off, &n) < 0)
+		return -1;
+	offs = nil;
+	if(n.nents > 0)
+		offs = emallocz(n.nents*sizeof(vlong), 0);
+	for(i = 0; i < n.nents; i++){
+		offs[i] = imgchild(&n, i);
+		if(offs[i] >= 0)
+			offs[i] = _wrimg(b, im, counts, offs[i], offp, nnodes);
+		if(offs[i] < 0){
+			free(offs);
+			return -1;
+		}
+	}
+	off = *offp;
+	buf[0] = n.kind;
+	PBIT32(buf+1, n.nents);
+	PBIT32(buf+5, n.nvals);
+	PBIT16(buf+9, n.npfx);
+	if(Bwrite(b, buf, Tnodesz) != Tnodesz)
+		goto fail;
+	if(Bwrite(b, n.pfx, n.npfx*Trunesz) != n.npfx*Trunesz)
+		goto fail;
+	for(i = 0; i < n.nents; i++){
+		memmove(buf, n.ents + i*Tentsz, Trunesz);
+		PBIT64(buf+4, offs[i]);
+		if(Bwrite(b, buf, Tentsz) != Tentsz)
+			goto fail;
+	}
+	nb = 0;
+	if(n.kind == Pdelta){
+		PBIT32(buf, n.nvbytes);
+		if(Bwrite(b, buf, 4) != 4)
+			goto fail;
+		nb = 4;
+	}
+	if(Bwrite(b, n.vals, n.nvbytes) != n.nvbytes)
+		goto fail;
+	*offp += Tnodesz + n.npfx*Trunesz + n.nents*Tentsz + nb + n.nvbytes;
+	if(counts){
+		PBIT32(buf, n.nfbytes);
+		if(Bwrite(b, buf, 4) != 4 || Bwrite(b, n.freqs, n.nfbytes) != n.nfbytes)
+			goto fail;
+		*offp += 4 + n.nfbytes;
+	}
+	(*nnodes)++;
+	free(offs);
+	return off;
+fail:
+	free(offs);
+	return -1;
+}
+
+static vlong
+_wrtrie(Biobuf* b, Trie* t, Timg* im, int counts, vlong* offp, long* nnodes)
+{
+	uchar	buf[Tentsz];
+	vlong*	offs;
+	vlong	off;
+	uchar*	d;
+	int	i, nb;
+
+	if(t->imgoff != 0)
+		return _wrimg(b, im, counts, t->imgoff, offp, nnodes);
+	offs = nil;
+	if(t->nents > 0)
+		offs = emallocz(t->nents*sizeof(vlong), 0);
+	for(i = 0; i < t->nents; i++){
+		offs[i] = _wrtrie(b, t->ents[i].t, im, counts, offp, nnodes);
+		if(offs[i] < 0){
+			free(offs);
+			return -1;
+		}
+	}
+	if(t->npfx > Npfx){
+		werrstr("prefix of %d runes", t->npfx);
+		goto fail;
+	}
+	off = *offp;
+	buf[0] = Pdelta;
+	PBIT32(buf+1, t->nents);
+	PBIT32(buf+5, t->post.n);
+	PBIT16(buf+9, t->npfx);
+	if(Bwrite(b, buf, Tnodesz) != Tnodesz)
+		goto fail;
+	for(i = 0; i < t->npfx; i++){
+		PBIT32(buf, t->pfx[i]);
+		if(Bwrite(b, buf, Trunesz) != Trunesz)
+			goto fail;
+	}
+	for(i = 0; i < t->nents; i++){
+		PBIT32(buf, t->ents[i].r);
+		PBIT64(buf+4, offs[i]);
+		if(Bwrite(b, buf, Tentsz) != Tentsz)
+			goto fail;
+	}
+	d = postdelta(&t->post, &nb);
+	PBIT32(buf, nb);
+	if(Bwrite(b, buf, 4) != 4 || Bwrite(b, d, nb) != nb){
+		free(d);
+		goto fail;
+	}
+	free(d);
+	*offp += Tnodesz + t->npfx*Trunesz + t->nents*Tentsz + 4 + nb;
+	if(counts){
+		d = freqdelta(&t->freq, &nb);
+		PBIT32(buf, nb);
+		if(Bwrite(b, buf, 4) != 4 || Bwrite(b, d, nb) != nb){
+			free(d);
+			goto fail;
+		}
+		free(d);
+		*offp += 4 + nb;
+	}
+	(*nnodes)++;
+	free(offs);
+	return off;
+fail:
+	free(offs);
+	return -1;
+}
+
+/* Writes t using the binary format
+ */
 int
 wrtrie(Biobuf* b, Trie* t)
 {
-	int	i;
+	uchar	buf[Thdrsz+Tdocsz];
+	vlong	off;
+	vlong	root;
+	long	nnodes;
+	u32int	i;
 
-	if(t->nvals > 0 && Bprint(b, "%llux", t->vals[0]) < 0)
+	memmove(buf, tmagic, 8);
+	PBIT32(buf+8, Tvers);
+	PBIT32(buf+12, Fdocids | (t->counts ? Fcounts : 0));
+	PBIT32(buf+16, t->docs->n);
+	if(Bwrite(b, buf, Thdrsz+Tdocsz) != Thdrsz+Tdocsz)
 		return -1;
-	for(i = 1; i < t->nsvals; i++)
-		if(Bprint(b, " %lux", t->svals[i]) < 0)
+	for(i = 0; i < t->docs->n; i++){
+		PBIT64(buf, docqid(t->docs, i));
+		if(Bwrite(b, buf, Dqidsz) != Dqidsz)
 			return -1;
-	for(i = 1; i < t->nvals; i++)
-		if(Bprint(b, " %llux", t->vals[i]) < 0)
+	}
+	off = Thdrsz + Tdocsz + (vlong)t->docs->n*Dqidsz;
+	nnodes = 0;
+	root = _wrtrie(b, t, t->img, t->counts, &off, &nnodes);
+	if(root < 0)
+		return -1;
+	PBIT64(buf, (uvlong)nnodes);
+	PBIT64(buf+8, root);
+	if(Bwrite(b, buf, Tlrsz) != Tlrsz)
+		return -1;
+	return 0;
+}
+
+static int
+_wrtrietext(Biobuf* b, Trie* t, Docs* d)
+{
+	int	i;
+	char*	sep;
+	u32int*	v;
+
+	for(i = 0; i < t->npfx; i++)
+		if(Bprint(b, "\n1\n%C\n", t->pfx[i]) < 0)
 			return -1;
+	sep = "";
+	v = emallocz(t->post.n*sizeof(u32int), 0);
+	postvals(&t->post, v);
+	for(i = 0; i < t->post.n; i++, sep = " ")
+		if(Bprint(b, "%s%llux", sep, docqid(d, v[i])) < 0){
+			free(v);
+			return -1;
+		}
+	free(v);
 	if(Bprint(b, "\n%d\n", t->nents) < 0)
 		return -1;
 	for(i = 0; i < t->nents; i++){
 		if(Bprint(b, "%C\n", t->ents[i].r) < 0)
 			return -1;
-		if(wrtrie(b, t->ents[i].t) < 0)
+		if(_wrtrietext(b, t->ents[i].t, d) < 0)
 			return -1;
 	}
 	return 0;
 }
 
+/* Writes t using the old text format,
+ * which has a node per rune.
+ */
+int
+wrtrietext(Biobuf* b, Trie* t)
+{
+	return _wrtrietext(b, t, t->docs);
+}
+
 static void	
-_printtrie(Biobuf* b, Trie* t, char* pref)
+_printtrie(Biobuf* b, Trie* t, Docs* d, char* pref)
 {
 	int	i;
 	char*	s;
+	u32int*	v;
 	int	nc;
 	int	l;
 
-	Bprint(b, "prefix '%s':", pref);
-	for(i = 0; i < t->nsvals; i++)
-		Bprint(b, " %lux", t->svals[i]);
-	for(i = 0; i < t->nvals; i++)
-		Bprint(b, " %llux", t->vals[i]);
-	Bprint(b, " (%d ents)\n", t->nents);
 	l = strlen(pref);
-	s = emallocz(l+UTFmax+1, 0);
+	s = emallocz(l+(t->npfx+1)*UTFmax+1, 0);
 	strcpy(s, pref);
+	for(i = 0; i < t->npfx; i++)
+		l += runetochar(s+l, &t->pfx[i]);
+	s[l] = 0;
+	Bprint(b, "prefix '%s':", s);
+	v = emallocz(t->post.n*sizeof(u32int), 0);
+	postvals(&t->post, v);
+	for(i = 0; i < t->post.n; i++)
+		Bprint(b, " %llux", docqid(d, v[i]));
+	free(v);
+	Bprint(b, " (%d ents)\n", t->nents);
 	for(i = 0; i < t->nents; i++){
 		nc = runetochar(s+l, &t->ents[i].r);
 		s[l+nc] = 0;
-		_printtrie(b, t->ents[i].t, s);
+		_printtrie(b, t->ents[i].t, d, s);
 	}
 	free(s);
 }
@@ -321,5 +1423,5 @@ _printtrie(Biobuf* b, Trie* t, char* pref)
 void
 printtrie(Biobuf* b, Trie* t)
 {
-	_printtrie(b, t, "");
+	_printtrie(b, t, t->docs, "");
 }
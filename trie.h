@@ -1,10 +1,36 @@
 
 enum {
-	Incr = 8	// we grow arrays in k*Incr items
+	Incr = 8,	// we grow arrays in k*Incr items
+
+	/* child lookup, see trie.c
+	 */
+	Nlinear = 8,	// nodes with up to Nlinear children are scanned
+	Ndirect = 32,	// nodes with Ndirect children get a direct index
+	Ndir = 256,	// for runes below Ndir
+	Npfx = 0xFFFF,	// runes in a node pfx, as npfx in the format
+
+	/* binary database format, see trie.c
+	 */
+	Tvers = 4,
+	Thdrsz = 16,	// magic, version, flags
+	Tdocsz = 4,	// # of doc ids, after the header
+	Tlrsz = 16,	// # of nodes, root offset
+	Tnodesz = 11,	// value kind, # of ents, # of values, # of pfx runes
+	Tnode1sz = 9,	// same, for version 1
+	Trunesz = 4,
+	Tentsz = 12,	// rune, child offset
+	Tvalsz = 8,
+
+	Praw = 0,	// values kept as 8 byte integers
+	Pdelta,		// sorted, varint deltas
+
+	Fdocids = 1,	// header flag: values are doc ids
+	Fcounts = 2,	// header flag: nodes have occurrence counts
 };
 
 typedef struct Trie Trie;
 typedef struct Tent Tent;
+typedef struct Timg Timg;
 
 struct Tent {
 	Rune	r;
@@ -14,22 +40,53 @@ struct Tent {
 struct Trie {
 	Tent*	ents;	// ents[i].r are runes for childs
 	int	nents;	// ents[i].t are children
-	int	aents;	// # of ents allocated
-	uvlong*	vals;	// values for this node prefix
-	int	nvals;	// # of values in use
-	ulong*	svals;	// small values (fit in a long)
-	int	nsvals;	// # of small values in use
+	int	npfx;	// # of runes in pfx
+	Rune*	pfx;	// runes after the one leading here
+	ushort*	dir;	// 1 + index in ents for runes < Ndir, or nil
+	Post	post;	// values for this node prefix
+	Pfreq	freq;	// times each value was put, if counts
+	Arena*	arena;	// where nodes come from, or nil
+	Docs*	docs;	// doc ids for the values, in the root
+	Timg*	img;	// where nodes not loaded are, in the root
+	int	counts;	// values put more than once are counted, in the root
+	vlong	imgoff;	// if not 0, the node is not loaded, see opentrie
+	int	gen;	// version that may change the node, see trienext
+};
+
+/* A binary database mapped in memory.
+ * It may be searched in place.
+ */
+struct Timg {
+	uchar*	data;
+	vlong	size;
+	int	vers;
+	int	flags;
+	Docs*	docs;	// for translating values to qids
+	vlong	nnodes;
+	vlong	root;	// offset for the root node
 };
 
 Trie*	alloctrie(void);
 void	trieput(Trie* t, char* k, vlong v);
 Trie*	trieget(Trie* t, char* k);
+Trie*	triefind(Trie* t, char* k, vlong* offp);
+Trie*	trienext(Trie* t);
+void	freeversion(Trie* t, Adead* d);
 void	freetrie(Trie* t);
 Trie*	rdtrie(Biobuf* b);
+Trie*	opentrie(char* fname);
 int	wrtrie(Biobuf* b, Trie* t);
+int	wrtrietext(Biobuf* b, Trie* t);
+Timg*	openimg(char* fname);
+void	closeimg(Timg* im);
+vlong	imgget(Timg* im, char* k);
+int	imgvals(Timg* im, vlong off, u32int* v);
+int	imgfreq(Timg* im, vlong off, Pfreq* f);
 void	printtrie(Biobuf* b, Trie* t);
 
 extern long ntries;
 extern long maxvals;
 extern long nvaltries;
-extern Trie roott;	// profiling. Entries used at the root node.
+extern int usearenas;	// allocate tries from arenas
+extern int usefreqs;	// new tries count values put more than once
+extern Trie roott;	// profiling. First runes of the keys put.
@@ -2,6 +2,9 @@
 #include <libc.h>
 #include "util.h"
 #include <stdio.h>
+#ifndef ONPLAN9
+#include <sys/mman.h>
+#endif
 
 int debug;
 
@@ -70,6 +73,48 @@ cleanpath(char* file)
 }
 
 #ifdef ONPLAN9
+/* There is no mmap here. Read the whole file
+ * in a single request instead.
+ */
+uchar*
+mapfile(char* fname, vlong* szp)
+{
+	int	fd;
+	Dir*	d;
+	uchar*	p;
+
+	fd = open(fname, OREAD);
+	if(fd < 0)
+		return nil;
+	d = dirfstat(fd);
+	if(d == nil){
+		close(fd);
+		return nil;
+	}
+	*szp = d->length;
+	free(d);
+	// emallocz takes an int.
+	if(*szp <= 0 || *szp > 0x7fffffff){
+		close(fd);
+		werrstr("%s: %s", fname, *szp <= 0 ? "empty file" : "file too large");
+		return nil;
+	}
+	p = emallocz(*szp, 0);
+	if(readn(fd, p, *szp) != *szp){
+		close(fd);
+		free(p);
+		return nil;
+	}
+	close(fd);
+	return p;
+}
+
+void
+unmapfile(uchar* p, vlong)
+{
+	free(p);
+}
+
 int
 myrename(char* to, char* frompath)
 {
@@ -86,10 +131,63 @@ myrename(char* to, char* frompath)
 		return -1;
 	return 0;
 }
+
+/* Writes are in the file server once they return.
+ */
+int
+syncfile(int)
+{
+	return 0;
+}
 #else
+uchar*
+mapfile(char* fname, vlong* szp)
+{
+	int	fd;
+	Dir*	d;
+	void*	p;
+
+	fd = open(fname, OREAD);
+	if(fd < 0)
+		return nil;
+	d = dirfstat(fd);
+	if(d == nil){
+		close(fd);
+		return nil;
+	}
+	*szp = d->length;
+	free(d);
+	if(*szp <= 0){
+		close(fd);
+		werrstr("%s: empty file", fname);
+		return nil;
+	}
+	p = mmap(nil, *szp, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p == MAP_FAILED){
+		werrstr("mmap: %r");
+		return nil;
+	}
+	return p;
+}
+
+void
+unmapfile(uchar* p, vlong sz)
+{
+	munmap(p, sz);
+}
+
 int
 myrename(char *to, char *frompath)
 {
 	return rename(frompath, to);
 }
+
+/* Make what was written to fd stable.
+ */
+int
+syncfile(int fd)
+{
+	return fsync(fd);
+}
 #endif
@@ -3,5 +3,8 @@ char*	estrdup(char* s);
 void*	emallocz(int sz, int zero);
 char*	cleanpath(char* f);
 int	myrename(char* to, char* frompath);
+int	syncfile(int fd);
+uchar*	mapfile(char* fname, vlong* szp);
+void	unmapfile(uchar* p, vlong sz);
 extern int debug;
 